@@ -153,44 +153,22 @@ void Game::UpdateModel()
 	}
 
 	//vtree.commit();
+
+	// Balls moved in place, so their cached bounds need reloading and the ones that left their node moving
+	vtree.refresh_bounds();
 	
-	for( auto& lball : vtree ) {
-		/*auto [node, it] = tree.find( lball );
-
-		if( node == nullptr ) continue;
-		for( auto& data : node->elements() ) {
-			auto& rball = data.object();
-
-			if( &lball == &rball )continue;
-
-			if( is_colliding( lball, rball ) ) {
-				resolve( lball, rball );
-				lball.set_collide_color();
-				rball.set_collide_color();
-			}
-			else {
-				lball.set_contained_color();
-				rball.set_contained_color();
-			}
-
-		}*/
-
-		auto colliding = vtree.query( lball.get_aabb() );
-		for( auto* pball : colliding ) {
-			auto& rball = *pball;
-			if( &lball == &rball )continue;
-
-			if( is_colliding( lball, rball ) ) {
-				resolve( lball, rball );
-				lball.set_collide_color();
-				rball.set_collide_color();
-			}
-			else {
-				lball.set_contained_color();
-				rball.set_contained_color();
-			}
+	// Each overlapping pair is reported once, so resolve only runs once per pair
+	vtree.for_each_overlapping_pair( []( Ball& lball, Ball& rball ) {
+		if( is_colliding( lball, rball ) ) {
+			resolve( lball, rball );
+			lball.set_collide_color();
+			rball.set_collide_color();
 		}
-	}
+		else {
+			lball.set_contained_color();
+			rball.set_contained_color();
+		}
+	} );
 }
 
 void Game::ComposeFrame()
@@ -44,6 +44,8 @@ using Recti = Rect<int>;
 struct ChiliRectAccess {
 	using rect_type = Rectf;
 	using scalar_type = float;
+	// Rect stores left, right, top, bottom in that order
+	static constexpr rect_kernels::packed_layout packed_float_layout = { 0, 2, 1, 3 };
 
 	static constexpr auto construct( scalar_type left_, scalar_type top_, scalar_type right_, scalar_type bottom_ )noexcept {
 		return rect_type{ left_, right_, top_, bottom_ };
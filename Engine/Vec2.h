@@ -61,6 +61,7 @@ using Point = Vec2<int>;
 struct ChiliVecAccess{
 	using vector_type = Vec2f;
 	using scalar_type = float;
+	static constexpr bool packed_floats = true;
 
 	static constexpr auto construct( scalar_type x_, scalar_type y_ )noexcept {
 		return vector_type{ x_, y_ };
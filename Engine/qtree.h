@@ -1,24 +1,282 @@
 #pragma once
 
+#include "query_shapes.h"
+#include "rect_kernels.h"
 #include "rect_traits.h"
+#include "thread_pool.h"
 #include "vector_traits.h"
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <concepts>
+#include <cstdint>
 #include <cstdlib>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <queue>
+#include <span>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 template<typename T>
 void swap_and_pop( std::vector<T>& vec, typename std::vector<T>::iterator iter ) {
 	if( vec.empty() )return;
-	if( vec.size() == std::size_t( 1 ) )vec.pop_back();
-	
-	*iter = vec.back();
+	if( iter != vec.end() - 1 )*iter = std::move( vec.back() );
+
 	vec.pop_back();
 }
 
+// Pending entries of the iterative tree walks.  The first capacity entries live inline,
+// only degenerate trees deep enough to need more spill over to the heap.
+template<typename T, std::size_t capacity = 64>
+class traversal_stack {
+public:
+	bool empty()const noexcept {
+		return m_size == std::size_t{};
+	}
+	std::size_t size()const noexcept {
+		return m_size;
+	}
+	void push( T const& value ) {
+		if( m_size < capacity ) m_inline[ m_size ] = value;
+		else m_overflow.push_back( value );
+		++m_size;
+	}
+	T pop()noexcept {
+		--m_size;
+		if( m_size < capacity ) return m_inline[ m_size ];
+
+		auto value = m_overflow.back();
+		m_overflow.pop_back();
+		return value;
+	}
+private:
+	std::array<T, capacity> m_inline = {};
+	std::vector<T> m_overflow;
+	std::size_t m_size = std::size_t{};
+};
+
+// Pushes the children of n picked by mask, bit i for child( i ), skipping ones that don't exist
+template<typename Stack, typename Node>
+void push_children( Stack& pending, Node& n, unsigned mask ) {
+	for( ; mask != 0u; mask &= mask - 1u ) {
+		if( auto* child = n.child( std::size_t( std::countr_zero( mask ) ) ) )
+			pending.push( child );
+	}
+}
+
+// Depth first walk from start without recursion.  visit( node ) handles a node's elements and
+// returns a mask of the children to go on to, bit i for child( i ).
+template<typename Node, typename Visit>
+void walk_tree( Node& start, Visit&& visit ) {
+	traversal_stack<Node*> pending;
+	pending.push( &start );
+	while( !pending.empty() ) {
+		auto& current = *pending.pop();
+		push_children( pending, current, visit( current ) );
+	}
+}
+
+// Child mask for walk_tree of the children of n that pass test
+template<typename Node, typename Test>
+unsigned children_where( Node& n, Test&& test ) {
+	auto mask = 0u;
+	for( std::size_t index = 0; index < 4; ++index ) {
+		auto* child = n.child( index );
+		if( child != nullptr && test( *child ) ) mask |= 1u << index;
+	}
+	return mask;
+}
+constexpr unsigned all_children = 0xfu;
+
+// Interleaves the low 16 bits of x and y into a Z-order ( Morton ) code
+constexpr std::uint32_t morton_encode( std::uint32_t x, std::uint32_t y )noexcept {
+	auto spread = []( std::uint32_t v ) {
+		v &= 0x0000ffff;
+		v = ( v | ( v << 8 ) ) & 0x00ff00ff;
+		v = ( v | ( v << 4 ) ) & 0x0f0f0f0f;
+		v = ( v | ( v << 2 ) ) & 0x33333333;
+		v = ( v | ( v << 1 ) ) & 0x55555555;
+		return v;
+	};
+	return spread( x ) | ( spread( y ) << 1 );
+}
+
+// Indices of rects sorted by the Morton code of their centers within bounds
+template<typename RectTraits>
+std::vector<std::size_t> morton_order(
+	typename RectTraits::rect_type const& bounds,
+	std::span<typename RectTraits::rect_type const> rects )
+{
+	const auto width = double( RectTraits::right( bounds ) ) - double( RectTraits::left( bounds ) );
+	const auto height = double( RectTraits::bottom( bounds ) ) - double( RectTraits::top( bounds ) );
+	auto cell = []( double offset, double extent ) {
+		if( !( extent > 0.0 ) ) return std::uint32_t{};
+		return std::uint32_t( std::clamp( offset / extent, 0.0, 1.0 ) * 65535.0 );
+	};
+
+	std::vector<std::uint32_t> codes( rects.size() );
+	for( std::size_t i = 0; i < rects.size(); ++i ) {
+		const auto cx = ( double( RectTraits::left( rects[ i ] ) ) + double( RectTraits::right( rects[ i ] ) ) ) * 0.5;
+		const auto cy = ( double( RectTraits::top( rects[ i ] ) ) + double( RectTraits::bottom( rects[ i ] ) ) ) * 0.5;
+		codes[ i ] = morton_encode(
+			cell( cx - double( RectTraits::left( bounds ) ), width ),
+			cell( cy - double( RectTraits::top( bounds ) ), height )
+		);
+	}
+
+	std::vector<std::size_t> order( rects.size() );
+	std::iota( order.begin(), order.end(), std::size_t{} );
+	std::sort( order.begin(), order.end(), [&]( std::size_t lhs, std::size_t rhs ) {
+		return codes[ lhs ] < codes[ rhs ];
+	} );
+
+	return order;
+}
+
+// Cells of an 8x8 grid over frame that rect touches, bit ( row * 8 ) + column.  Edges past the
+// frame land in the border cells, so the masks of two intersecting rects always share a bit.
+template<typename RectTraits>
+std::uint64_t occupancy_cells(
+	typename RectTraits::rect_type const& frame,
+	typename RectTraits::rect_type const& rect )noexcept
+{
+	using real = std::common_type_t<std::remove_cvref_t<typename RectTraits::scalar_type>, float>;
+	auto cell = []( real position, real origin, real scale ) {
+		const auto scaled = std::floor( ( position - origin ) * scale );
+		if( !( scaled > real( 0 ) ) ) return 0u;
+		return scaled >= real( 7 ) ? 7u : unsigned( scaled );
+	};
+	auto scale_of = []( real low, real high ) {
+		return high > low ? real( 8 ) / ( high - low ) : real( 0 );
+	};
+
+	const auto left = real( RectTraits::left( frame ) );
+	const auto top = real( RectTraits::top( frame ) );
+	const auto scale_x = scale_of( left, real( RectTraits::right( frame ) ) );
+	const auto scale_y = scale_of( top, real( RectTraits::bottom( frame ) ) );
+	const auto column_a = cell( real( RectTraits::left( rect ) ), left, scale_x );
+	const auto column_b = cell( real( RectTraits::right( rect ) ), left, scale_x );
+	const auto row_a = cell( real( RectTraits::top( rect ) ), top, scale_y );
+	const auto row_b = cell( real( RectTraits::bottom( rect ) ), top, scale_y );
+	// min and max so inverted rects still cover every cell they could intersect in
+	const auto column_first = std::min( column_a, column_b ), column_last = std::max( column_a, column_b );
+	const auto row_first = std::min( row_a, row_b ), row_last = std::max( row_a, row_b );
+
+	// One byte per row, so the column bits times a 1 in each covered row's byte
+	const auto columns = std::uint64_t( ( 2u << column_last ) - ( 1u << column_first ) );
+	const auto rows = ( 0x0101010101010101ull >> ( 8 * ( 7 - ( row_last - row_first ) ) ) ) << ( 8 * row_first );
+	return columns * rows;
+}
+
+// A node a bulk build still has to fill and the items headed for it, in insertion order
+template<typename Node>
+struct build_part {
+	Node* pnode = nullptr;
+	std::vector<std::size_t> items;
+};
+
+// Hands items out between root and its descendants the way inserting them one at a time would:
+// an item stays in the first node that is full or has no quadrant containing it.  Parts with more
+// than split_size items are split another level, the rest are returned largest first for the
+// caller to build, each independent of the others.  keep( node, item ) stores an item in a node,
+// make_child( node, index, item ) returns that child of node, creating it if needed, where item is
+// the first one headed into it, the one whose insert would have created it.
+template<std::size_t max_objects, typename RectTraits, typename Node, typename Keep, typename MakeChild>
+std::vector<build_part<Node>> partition_build(
+	Node& root,
+	std::span<typename RectTraits::rect_type const> bounds,
+	std::size_t split_size,
+	Keep&& keep,
+	MakeChild&& make_child )
+{
+	std::vector<build_part<Node>> parts;
+	std::vector<build_part<Node>> pending( 1 );
+	pending.front().pnode = &root;
+	pending.front().items.resize( bounds.size() );
+	std::iota( pending.front().items.begin(), pending.front().items.end(), std::size_t{} );
+
+	while( !pending.empty() ) {
+		auto part = std::move( pending.back() );
+		pending.pop_back();
+		if( part.items.size() <= split_size ) {
+			if( !part.items.empty() ) parts.push_back( std::move( part ) );
+			continue;
+		}
+
+		auto& current = *part.pnode;
+		std::array<std::vector<std::size_t>, 4> quadrants;
+		for( auto item : part.items ) {
+			const auto index = current.elements().size() >= max_objects ? -1 :
+				RectTraits::quadrant_containing( current.bounds(), bounds[ item ] );
+			if( index < 0 ) keep( current, item );
+			else quadrants[ index ].push_back( item );
+		}
+		for( int index = 0; index < 4; ++index ) {
+			if( quadrants[ index ].empty() ) continue;
+			pending.push_back( { &make_child( current, index, quadrants[ index ].front() ), std::move( quadrants[ index ] ) } );
+		}
+	}
+
+	std::sort( parts.begin(), parts.end(), []( auto const& lhs, auto const& rhs ) {
+		return lhs.items.size() > rhs.items.size();
+	} );
+	return parts;
+}
+
+// Parts small enough that every thread gets several, so one crowded quadrant doesn't hold up the rest
+inline std::size_t build_split_size( std::size_t count, thread_pool const& pool )noexcept {
+	constexpr auto min_part = std::size_t( 2048 );
+	return std::max( count / ( pool.size() * 8 ), min_part );
+}
+
+// Fills out[ i ] with get_rect( objects[ i ] ), a slice per thread
+template<typename Objects, typename GetRect, typename Rect>
+void compute_bounds( Objects const& objects, GetRect const& get_rect, std::vector<Rect>& out, thread_pool& pool ) {
+	out.resize( objects.size() );
+	const auto slice = std::max( ( objects.size() + pool.size() - 1 ) / pool.size(), std::size_t( 1 ) );
+	pool.run( ( objects.size() + slice - 1 ) / slice, [&]( std::size_t index ) {
+		const auto last = std::min( ( index + 1 ) * slice, objects.size() );
+		for( auto i = index * slice; i < last; ++i ) {
+			out[ i ] = get_rect( objects[ i ] );
+		}
+	} );
+}
+
+// How query_spans treats nodes that only partly overlap the query
+enum class partial_nodes {
+	filter,	// their elements are tested and hits returned as pointers
+	defer	// they are returned as spans with fully_contained == false for the caller to test
+};
+
+enum class raycast_mode {
+	first_hit,	// only the closest hit, traversal stops once it is confirmed
+	all_hits	// every hit along the ray, sorted by distance
+};
+
+// Limits on one slice of a budgeted query, whichever runs out first ends the slice.
+// Every slice visits at least one node and tests one element so a query always makes progress.
+struct query_budget {
+	using clock = std::chrono::steady_clock;
+
+	std::size_t max_node_visits = std::numeric_limits<std::size_t>::max();
+	std::size_t max_element_tests = std::numeric_limits<std::size_t>::max();
+	clock::time_point deadline = clock::time_point::max();
+
+	// The clock is only read every so many element tests, reading it per test would cost more than the test
+	static constexpr std::size_t clock_interval = 64;
+
+	bool out_of_time()const {
+		return deadline != clock::time_point::max() && clock::now() >= deadline;
+	}
+};
+
 namespace primary
 {
 	template<
@@ -33,6 +291,7 @@ namespace primary
 
 			using rect_type = typename rect_traits::rect_type;
 			using vec_type = typename vec_traits::vector_type;
+			using scalar_type = typename rect_traits::scalar_type;
 
 			using value_type = Object;
 			using pointer = Object*;
@@ -44,6 +303,11 @@ namespace primary
 			using const_iterator = typename std::vector<value_type>::const_iterator;
 			static constexpr std::size_t max_objects = allowed_objects_per_node;
 
+			struct ray_hit {
+				pointer object = nullptr;
+				scalar_type t = {};
+			};
+
 		public:
 			class data {
 			public:
@@ -70,6 +334,15 @@ namespace primary
 				pointer m_pObject = nullptr;
 			};
 
+			struct node_span {
+				std::span<data> elements;
+				bool fully_contained = false;
+			};
+			struct span_query_result {
+				std::vector<node_span> spans;
+				std::vector<pointer> hits;
+			};
+
 			class node {
 			public:
 				node( rect_type const& bounds_ )
@@ -90,24 +363,15 @@ namespace primary
 				rect_type const& bounds()const noexcept {
 					return m_bounds;
 				}
-			private:
-				using find_result = std::pair<node*, typename std::vector<data>::iterator>;
 
-				void query( rect_type const& bounds, std::vector<pointer>& contained ) {
-					if( rect_traits::intersects( m_bounds, bounds ) ) {
-						for( auto& child : m_pChildren ) {
-							if( child )
-								child->query( bounds, contained );
-						}
-
-						contained.reserve( m_data.size() + contained.size() );
-
-						for( auto& element : m_data ) {
-							if( rect_traits::intersects( element.bounds(), bounds ) )
-								contained.push_back( &element.object() );
-						}
-					}
+				node* child( std::size_t index )noexcept {
+					return m_pChildren[ index ].get();
+				}
+				node const* child( std::size_t index )const noexcept {
+					return m_pChildren[ index ].get();
 				}
+			private:
+				using find_result = std::pair<node*, typename std::vector<data>::iterator>;
 
 				rect_type get_quadrant( int index )const noexcept {
 					const auto left = rect_traits::left( m_bounds );
@@ -132,39 +396,38 @@ namespace primary
 					return rect_type{};
 				}
 
-				bool add_to_child( data const& data_ ) {
-					if( m_data.size() >= max_objects ) return false;
+				// Child whose quadrant contains bounds, created on demand, or nullptr if the object stays here
+				node* add_to_child( rect_type const& bounds ) {
+					if( m_data.size() >= max_objects ) return nullptr;
 
-					for( int index = 0; auto & child : m_pChildren ) {
-						auto quadrant = get_quadrant( index++ );
+					const auto index = rect_traits::quadrant_containing( m_bounds, bounds );
+					if( index < 0 ) return nullptr;
 
-						if( !rect_traits::contains( quadrant, data_.bounds() ) ) continue;
-						if( !child ) child = std::make_unique<node>( quadrant );
-						child->add_object( data_ );
-						return true;
-					}
-
-					return false;
+					auto& child = m_pChildren[ index ];
+					if( !child ) child = std::make_unique<node>( get_quadrant( index ) );
+					return child.get();
 				}
 
 				void add_object( data const& data_ ) {
-					if( !add_to_child( data_ ) ) {
-						m_data.push_back( data_ );
+					auto* pnode = this;
+					while( auto* pchild = pnode->add_to_child( data_.bounds() ) ) {
+						pnode = pchild;
 					}
+
+					pnode->m_data.push_back( data_ );
 				}
 
 				find_result find_node( const_reference object, rect_type const& bounds ) {
 					auto is_same = [&]( data const& data_ ) { return &data_.object() == &object; };
-					auto it = std::find_if( m_data.begin(), m_data.end(), is_same );
 
-					if( it != m_data.end() ) return { this, it };
+					traversal_stack<node*> pending;
+					pending.push( this );
+					while( !pending.empty() ) {
+						auto* pnode = pending.pop();
+						auto it = std::find_if( pnode->m_data.begin(), pnode->m_data.end(), is_same );
+						if( it != pnode->m_data.end() ) return { pnode, it };
 
-					for( int index = 0; auto & child : m_pChildren ) {
-						if( !child ) continue;
-						if( !rect_traits::intersects( child->bounds(), bounds ) )continue;
-
-						auto result = child->find_node( object, bounds );
-						if( result.first != nullptr ) return result;
+						push_children( pending, *pnode, rect_traits::quadrants_intersecting( pnode->bounds(), bounds ) );
 					}
 
 					return { nullptr, m_data.end() };
@@ -177,6 +440,27 @@ namespace primary
 				rect_type m_bounds;
 			};
 
+			// Where a budgeted query stopped.  Only good until the tree is next modified.
+			class query_cursor {
+			public:
+				bool done()const noexcept {
+					return m_done;
+				}
+			private:
+				friend class qtree;
+				rect_type m_bounds = {};
+				traversal_stack<node*> m_pending;
+				node* m_pcurrent = nullptr;
+				std::size_t m_next_element = std::size_t{};
+				std::size_t m_generation = std::size_t{};
+				qtree const* m_ptree = nullptr;
+				bool m_done = true;
+			};
+			struct budgeted_result {
+				std::vector<pointer> objects;
+				query_cursor cursor;
+			};
+
 			qtree( rect_type const& bounds_, std::function<rect_type( value_type const& )> get_rect_fn )
 				:
 				root( bounds_ ),
@@ -184,32 +468,69 @@ namespace primary
 			{}
 
 			void push( value_type const& object ) {
+				++generation;
 				objects.push_back( object );
 			}
 			void push( value_type&& object ) {
+				++generation;
 				objects.push_back( std::move( object ) );
 			}
 
 			template<typename...Args>
 			value_type& emplace( Args&&... args ) {
+				++generation;
 				return objects.emplace_back( std::forward<Args>( args )... );
 			}
 
 			void commit() {
+				++generation;
 				root = node( root.m_bounds );
 				for( auto& object : objects ) {
 					root.add_object( { get_rect( object ), &object } );
 				}
 			}
+			// Builds the same nodes as commit(), with the subtrees under the root's quadrants, or deeper
+			// ones for large inputs, each built on one of pool's threads.  get_rect is called from them too.
+			void commit( thread_pool& pool ) {
+				++generation;
+				root = node( root.m_bounds );
+
+				std::vector<rect_type> bounds;
+				compute_bounds( objects, get_rect, bounds, pool );
+				auto keep = [&]( node& n, std::size_t item ) {
+					n.m_data.push_back( { bounds[ item ], &objects[ item ] } );
+				};
+				auto make_child = [&]( node& n, int index, std::size_t ) -> node& {
+					auto& child = n.m_pChildren[ index ];
+					if( !child ) child = std::make_unique<node>( n.get_quadrant( index ) );
+					return *child;
+				};
+				auto parts = partition_build<max_objects, rect_traits>( root, std::span<rect_type const>( bounds ), build_split_size( objects.size(), pool ), keep, make_child );
+
+				try {
+					pool.run( parts.size(), [&]( std::size_t index ) {
+						for( auto item : parts[ index ].items ) {
+							parts[ index ].pnode->add_object( { bounds[ item ], &objects[ item ] } );
+						}
+					} );
+				}
+				catch( ... ) {
+					root = node( root.m_bounds );
+					throw;
+				}
+			}
 
 			void reserve( std::size_t count ) {
 				if( count > objects.max_size() )
 					throw std::invalid_argument( "max_size exceeded" );
-				if( count > objects.size() )
+				if( count > objects.size() ) {
+					++generation;
 					objects.reserve( count );
+				}
 			}
 
 			void clear()noexcept {
+				++generation;
 				root = node( root.m_bounds );
 				objects.clear();
 			}
@@ -229,11 +550,258 @@ namespace primary
 			}
 
 			std::vector<pointer> query( rect_type const& bounds ) {
+				return query_in( *this, bounds );
+			}
+			// The const read paths change nothing, so any number of threads may run them at once
+			// while nothing modifies the tree
+			std::vector<const_pointer> query( rect_type const& bounds )const {
+				return query_in( *this, bounds );
+			}
+
+			// Same as query( bounds ) but stops once budget runs out.  If cursor isn't done
+			// the rest of the results can be had with resume, for example on the next frame.
+			budgeted_result query( rect_type const& bounds, query_budget const& budget ) {
+				budgeted_result result;
+				auto& cursor = result.cursor;
+				cursor.m_bounds = bounds;
+				cursor.m_generation = generation;
+				cursor.m_ptree = this;
+				cursor.m_done = false;
+				if( rect_traits::intersects( root.bounds(), bounds ) )
+					cursor.m_pending.push( &root );
+
+				run_cursor( cursor, budget, result.objects );
+				return result;
+			}
+
+			// Continues a budgeted query within a new budget, returning the objects found in this slice.
+			// Throws if the tree was modified after the query was started.
+			std::vector<pointer> resume( query_cursor& cursor, query_budget const& budget ) {
 				std::vector<pointer> objects;
-				root.query( bounds, objects );
+				run_cursor( cursor, budget, objects );
 				return objects;
 			}
 
+			// Objects overlapping any shape satisfying query_shape, such as convex_polygon,
+			// rotated_rect or view_frustum.  Nodes fully inside the shape are taken whole.
+			template<query_shape<RectTraits> Shape>
+			std::vector<pointer> query( Shape const& shape ) {
+				std::vector<pointer> objects;
+				if( shape.classify( root.bounds() ) == shape_overlap::outside ) return objects;
+
+				// Second is set once a node is inside the shape, its subtree is then taken untested.
+				// The root never is since it may hold objects that stick out of its bounds.
+				traversal_stack<std::pair<node*, bool>> pending;
+				pending.push( { &root, false } );
+				while( !pending.empty() ) {
+					const auto [pnode, inside] = pending.pop();
+					for( auto& element : pnode->m_data ) {
+						if( inside || shape.intersects( element.bounds() ) )
+							objects.push_back( &element.object() );
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto overlap = inside ? shape_overlap::inside : shape.classify( child->bounds() );
+						if( overlap != shape_overlap::outside )
+							pending.push( { child.get(), overlap == shape_overlap::inside } );
+					}
+				}
+				return objects;
+			}
+
+			// Like query, but nodes the query fully covers come back whole as spans over their
+			// elements with no per element tests.  Partly covered nodes are handled per mode.
+			span_query_result query_spans( rect_type const& bounds, partial_nodes mode = partial_nodes::filter ) {
+				span_query_result result;
+				if( !rect_traits::intersects( root.bounds(), bounds ) ) return result;
+
+				// Second is set for nodes inside bounds, never the root for the same reason as above
+				traversal_stack<std::pair<node*, bool>> pending;
+				pending.push( { &root, false } );
+				while( !pending.empty() ) {
+					const auto [pnode, contained] = pending.pop();
+					if( !pnode->m_data.empty() ) {
+						if( contained || mode == partial_nodes::defer ) {
+							result.spans.push_back( { std::span<data>( pnode->m_data ), contained } );
+						}
+						else {
+							for( auto& element : pnode->m_data ) {
+								if( rect_traits::intersects( element.bounds(), bounds ) )
+									result.hits.push_back( &element.object() );
+							}
+						}
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+						if( contained )
+							pending.push( { child.get(), true } );
+						else if( rect_traits::intersects( child->bounds(), bounds ) )
+							pending.push( { child.get(), rect_traits::contains( bounds, child->bounds() ) } );
+					}
+				}
+				return result;
+			}
+
+			// Runs every query in one descent of the tree.  Queries are Morton ordered so
+			// neighbours share node visits; sink( query_index, pointer ) is called for each hit.
+			template<typename Sink>
+			void query_batch( std::span<rect_type const> queries, Sink&& sink ) {
+				batch_in( *this, queries, batch_order( queries ), sink );
+			}
+			template<typename Sink>
+			void query_batch( std::span<rect_type const> queries, Sink&& sink )const {
+				batch_in( *this, queries, batch_order( queries ), sink );
+			}
+
+			// query_batch spread over pool.  The Morton ordered queries are cut into one slice per sink
+			// and sinks[ slice ]( query_index, const_pointer ) gets that slice's hits, so each sink is
+			// only ever called from one thread at a time.
+			template<typename Sink>
+			void parallel_query_batch( std::span<rect_type const> queries, std::vector<Sink>& sinks, thread_pool& pool = thread_pool::shared() )const {
+				if( sinks.empty() )
+					throw std::invalid_argument( "parallel_query_batch needs at least one sink" );
+
+				const auto order = batch_order( queries );
+				const auto slice = ( order.size() + sinks.size() - 1 ) / sinks.size();
+				pool.run( sinks.size(), [&]( std::size_t index ) {
+					const auto first = std::min( index * slice, order.size() );
+					const auto last = std::min( first + slice, order.size() );
+					batch_in( *this, queries, std::vector<std::size_t>( order.begin() + first, order.begin() + last ), sinks[ index ] );
+				} );
+			}
+
+			// Calls callback( lhs, rhs ) once for every pair of objects whose bounds intersect.
+			// Each node's elements are tested against each other and against its descendants.
+			template<typename Callback>
+			void for_each_overlapping_pair( Callback&& callback ) {
+				// candidates[ first, last ) holds elements from ancestors whose bounds overlap pnode
+				struct pending_node {
+					node* pnode = nullptr;
+					std::size_t first = {}, last = {};
+				};
+				std::vector<std::pair<rect_type, pointer>> candidates;
+				traversal_stack<pending_node> pending;
+				pending.push( { &root, std::size_t{}, std::size_t{} } );
+				while( !pending.empty() ) {
+					const auto [pnode, first, last] = pending.pop();
+					candidates.resize( last );
+
+					for( auto& element : pnode->m_data ) {
+						auto const& element_bounds = element.bounds();
+						for( auto i = first; i < candidates.size(); ++i ) {
+							if( rect_traits::intersects( candidates[ i ].first, element_bounds ) )
+								callback( *candidates[ i ].second, element.object() );
+						}
+
+						// Later elements of this node are tested against this one as they are added
+						candidates.emplace_back( element_bounds, &element.object() );
+					}
+
+					const auto node_last = candidates.size();
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto child_first = candidates.size();
+						for( auto i = first; i < node_last; ++i ) {
+							if( rect_traits::intersects( child->bounds(), candidates[ i ].first ) )
+								candidates.push_back( candidates[ i ] );
+						}
+						pending.push( { child.get(), child_first, candidates.size() } );
+					}
+				}
+			}
+
+			// Objects whose bounds touch the circle at center with the given radius
+			std::vector<pointer> query_radius( vec_type const& center, scalar_type radius ) {
+				return radius_in( *this, center, radius );
+			}
+			std::vector<const_pointer> query_radius( vec_type const& center, scalar_type radius )const {
+				return radius_in( *this, center, radius );
+			}
+
+			// The k objects nearest to point, closest first.  Distance is measured to each object's bounds.
+			std::vector<pointer> nearest( vec_type const& point, std::size_t k ) {
+				return nearest_in( *this, point, k, std::numeric_limits<scalar_type>::max() );
+			}
+			std::vector<pointer> nearest( vec_type const& point, std::size_t k, scalar_type max_distance ) {
+				return nearest_in( *this, point, k, max_distance * max_distance );
+			}
+			std::vector<const_pointer> nearest( vec_type const& point, std::size_t k )const {
+				return nearest_in( *this, point, k, std::numeric_limits<scalar_type>::max() );
+			}
+			std::vector<const_pointer> nearest( vec_type const& point, std::size_t k, scalar_type max_distance )const {
+				return nearest_in( *this, point, k, max_distance * max_distance );
+			}
+
+			// Objects hit by origin + ( direction * t ) for t in [0, max_t], nearest first.
+			// Nodes are visited front to back so first_hit stops as soon as nothing closer can remain.
+			std::vector<ray_hit> raycast( vec_type const& origin, vec_type const& direction, scalar_type max_t, raycast_mode mode = raycast_mode::first_hit ) {
+				using node_entry = std::pair<scalar_type, node*>;
+				auto farther = []( auto const& lhs, auto const& rhs ) { return lhs.first > rhs.first; };
+				auto nearer = []( ray_hit const& lhs, ray_hit const& rhs ) { return lhs.t < rhs.t; };
+
+				std::priority_queue<node_entry, std::vector<node_entry>, decltype( farther )> pending( farther );
+				std::vector<ray_hit> hits;
+				auto limit = [&] {
+					return ( mode == raycast_mode::first_hit && !hits.empty() ) ? hits.front().t : max_t;
+				};
+
+				// Root may hold objects outside its bounds, so always visit it
+				pending.push( { scalar_type( 0 ), &root } );
+				while( !pending.empty() && pending.top().first <= limit() ) {
+					auto* pnode = pending.top().second;
+					pending.pop();
+
+					for( auto& element : pnode->m_data ) {
+						const auto t = rect_traits::template ray_entry<vec_traits>( element.bounds(), origin, direction, limit() );
+						if( !t ) continue;
+
+						if( mode == raycast_mode::all_hits ) {
+							hits.push_back( { &element.object(), *t } );
+						}
+						else if( hits.empty() || *t < hits.front().t ) {
+							hits.assign( 1, { &element.object(), *t } );
+						}
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto t = rect_traits::template ray_entry<vec_traits>( child->bounds(), origin, direction, limit() );
+						if( t ) pending.push( { *t, child.get() } );
+					}
+				}
+
+				std::sort( hits.begin(), hits.end(), nearer );
+				return hits;
+			}
+
+			// Objects touched by moving as it travels by displacement, earliest time of impact first.
+			// t is the fraction of displacement travelled, 0 for objects moving already touches.
+			std::vector<ray_hit> query_swept( rect_type const& moving, vec_type const& displacement ) {
+				auto entry = [&]( rect_type const& bounds ) {
+					return rect_traits::template swept_entry<vec_traits>( moving, displacement, bounds );
+				};
+
+				std::vector<ray_hit> hits;
+				if( !entry( root.bounds() ) ) return hits;
+
+				walk_tree( root,
+					[&]( node& current ) {
+						for( auto& element : current.m_data ) {
+							if( auto t = entry( element.bounds() ) )
+								hits.push_back( { &element.object(), *t } );
+						}
+						return children_where( current, [&]( node const& child ) { return entry( child.bounds() ).has_value(); } );
+					}
+				);
+				std::sort( hits.begin(), hits.end(), []( ray_hit const& lhs, ray_hit const& rhs ) { return lhs.t < rhs.t; } );
+				return hits;
+			}
+
 			void remove_object( pointer pobject ) {
 				if( objects.size() == 0 )return;
 
@@ -241,11 +809,12 @@ namespace primary
 				auto obj_it = std::find_if( objects.begin(), objects.end(), is_same );
 				if( obj_it != objects.end() )
 				{
+					++generation;
 					// Remove objects from nodes since the 
 					// nodes' object pointers will be invalid after removal
 					for( auto it = obj_it; it != objects.end(); ++it ) {
 						auto& removed = *it;
-						auto [n, rem_it] = root.find_object( removed, get_rect( removed ) );
+						auto [n, rem_it] = root.find_node( removed, get_rect( removed ) );
 						if( n != nullptr )
 							swap_and_pop( n->m_data, rem_it );
 					}
@@ -253,7 +822,7 @@ namespace primary
 					swap_and_pop( objects, obj_it );
 
 					for( ; obj_it != objects.end(); ++obj_it ) {
-						root.add_object( { get_rect( *obj_it ), *obj_it } );
+						root.add_object( { get_rect( *obj_it ), &*obj_it } );
 					}
 				}
 			}
@@ -262,9 +831,180 @@ namespace primary
 				return root.find_node( object, get_rect( object ) );
 			}
 		private:
+			void run_cursor( query_cursor& cursor, query_budget const& budget, std::vector<pointer>& found ) {
+				if( cursor.m_done ) return;
+				if( cursor.m_ptree != this || cursor.m_generation != generation )
+					throw std::runtime_error( "query cursor is stale, the tree was modified" );
+
+				auto visits = std::size_t{};
+				auto tests = std::size_t{};
+				for( ;; ) {
+					if( cursor.m_pcurrent == nullptr ) {
+						if( cursor.m_pending.empty() ) {
+							cursor.m_done = true;
+							return;
+						}
+						if( visits != std::size_t{} && ( visits >= budget.max_node_visits || budget.out_of_time() ) ) return;
+
+						++visits;
+						cursor.m_pcurrent = cursor.m_pending.pop();
+						cursor.m_next_element = std::size_t{};
+						push_children( cursor.m_pending, *cursor.m_pcurrent, rect_traits::quadrants_intersecting( cursor.m_pcurrent->bounds(), cursor.m_bounds ) );
+					}
+
+					auto& elements = cursor.m_pcurrent->m_data;
+					while( cursor.m_next_element < elements.size() ) {
+						if( tests != std::size_t{} && tests >= budget.max_element_tests ) return;
+						if( ++tests % query_budget::clock_interval == std::size_t{} && budget.out_of_time() ) return;
+
+						auto& element = elements[ cursor.m_next_element++ ];
+						if( rect_traits::intersects( element.bounds(), cursor.m_bounds ) )
+							found.push_back( &element.object() );
+					}
+					cursor.m_pcurrent = nullptr;
+				}
+			}
+
+			// Bodies shared by the const and non-const overloads, Self is qtree or qtree const
+			template<typename Self>
+			using object_pointer = std::conditional_t<std::is_const_v<Self>, const_pointer, pointer>;
+
+			template<typename Self>
+			static std::vector<object_pointer<Self>> query_in( Self& self, rect_type const& bounds ) {
+				std::vector<object_pointer<Self>> objects;
+				if( !rect_traits::intersects( self.root.bounds(), bounds ) ) return objects;
+
+				walk_tree( self.root,
+					[&]( auto& current ) {
+						for( auto& element : current.m_data ) {
+							if( rect_traits::intersects( element.bounds(), bounds ) )
+								objects.push_back( &element.object() );
+						}
+						return rect_traits::quadrants_intersecting( current.bounds(), bounds );
+					}
+				);
+				return objects;
+			}
+
+			template<typename Self>
+			static std::vector<object_pointer<Self>> radius_in( Self& self, vec_type const& center, scalar_type radius ) {
+				auto touches = [&]( rect_type const& bounds ) {
+					return rect_traits::template intersects<vec_traits>( bounds, center, radius );
+				};
+
+				std::vector<object_pointer<Self>> objects;
+				if( !touches( self.root.bounds() ) ) return objects;
+
+				walk_tree( self.root,
+					[&]( auto& current ) {
+						for( auto& element : current.m_data ) {
+							if( touches( element.bounds() ) )
+								objects.push_back( &element.object() );
+						}
+						return children_where( current, [&]( node const& child ) { return touches( child.bounds() ); } );
+					}
+				);
+				return objects;
+			}
+
+			// Queries in Morton order, less the ones that miss the root
+			std::vector<std::size_t> batch_order( std::span<rect_type const> queries )const {
+				auto order = morton_order<rect_traits>( root.bounds(), queries );
+				std::erase_if( order, [&]( std::size_t index ) {
+					return !rect_traits::intersects( root.bounds(), queries[ index ] );
+				} );
+				return order;
+			}
+
+			template<typename Self, typename Sink>
+			static void batch_in( Self& self, std::span<rect_type const> queries, std::vector<std::size_t> active, Sink& sink ) {
+				if( active.empty() ) return;
+
+				// active[ first, last ) holds the queries overlapping pnode.  Anything past last
+				// belongs to a sibling subtree that is already done.
+				using node_pointer = decltype( &self.root );
+				struct pending_node {
+					node_pointer pnode = nullptr;
+					std::size_t first = {}, last = {};
+				};
+				traversal_stack<pending_node> pending;
+				pending.push( { &self.root, std::size_t{}, active.size() } );
+				while( !pending.empty() ) {
+					const auto [pnode, first, last] = pending.pop();
+					active.resize( last );
+
+					for( auto& element : pnode->m_data ) {
+						for( auto i = first; i < last; ++i ) {
+							if( rect_traits::intersects( element.bounds(), queries[ active[ i ] ] ) )
+								sink( active[ i ], &element.object() );
+						}
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto child_first = active.size();
+						for( auto i = first; i < last; ++i ) {
+							if( rect_traits::intersects( child->bounds(), queries[ active[ i ] ] ) )
+								active.push_back( active[ i ] );
+						}
+						if( active.size() > child_first )
+							pending.push( { child.get(), child_first, active.size() } );
+					}
+				}
+			}
+
+			template<typename Self>
+			static std::vector<object_pointer<Self>> nearest_in( Self& self, vec_type const& point, std::size_t k, scalar_type max_distance_sqr ) {
+				using node_entry = std::pair<scalar_type, decltype( &self.root )>;
+				using hit_entry = std::pair<scalar_type, object_pointer<Self>>;
+				auto farther = []( auto const& lhs, auto const& rhs ) { return lhs.first > rhs.first; };
+				auto nearer = []( auto const& lhs, auto const& rhs ) { return lhs.first < rhs.first; };
+
+				// Nodes closest to point come off first, hits keeps the k best with the worst on top
+				std::priority_queue<node_entry, std::vector<node_entry>, decltype( farther )> pending( farther );
+				std::priority_queue<hit_entry, std::vector<hit_entry>, decltype( nearer )> hits( nearer );
+				auto limit = [&] { return hits.size() < k ? max_distance_sqr : hits.top().first; };
+
+				std::vector<object_pointer<Self>> result;
+				if( k == std::size_t{} ) return result;
+
+				// Root may hold objects outside its bounds, so always visit it
+				pending.push( { scalar_type( 0 ), &self.root } );
+				while( !pending.empty() && pending.top().first <= limit() ) {
+					auto* pnode = pending.top().second;
+					pending.pop();
+
+					for( auto& element : pnode->m_data ) {
+						const auto dist = rect_traits::template distance_sqr<vec_traits>( element.bounds(), point );
+						if( dist > limit() ) continue;
+
+						hits.push( { dist, &element.object() } );
+						if( hits.size() > k ) hits.pop();
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto dist = rect_traits::template distance_sqr<vec_traits>( child->bounds(), point );
+						if( dist <= limit() ) pending.push( { dist, child.get() } );
+					}
+				}
+
+				result.resize( hits.size() );
+				for( auto it = result.rbegin(); it != result.rend(); ++it ) {
+					*it = hits.top().second;
+					hits.pop();
+				}
+
+				return result;
+			}
+
 			std::vector<value_type> objects;
 			node root;
 			std::function<rect_type( const value_type& )> get_rect;
+			// Bumped by anything that can move nodes or objects, stale cursors are detected with it
+			std::size_t generation = std::size_t{};
 	};
 }
 
@@ -277,29 +1017,86 @@ namespace value_qtree
 	template<typename TreeType> class const_tree_iterator;
 	template<typename TreeType> class node_iterator;
 	template<typename TreeType> class const_node_iterator;
+	template<typename TreeA, typename TreeB> class tree_join;
+
+	// Monoid folded over the objects in every node's subtree, kept up to date on insert and erase.
+	// combine must be associative and commutative with identity() as its neutral element.
+	template<typename Aggregate, typename Object>
+	concept subtree_aggregate = requires( Object const& object, typename Aggregate::value_type const& value ) {
+		{ Aggregate::identity() } -> std::convertible_to<typename Aggregate::value_type>;
+		{ Aggregate::lift( object ) } -> std::convertible_to<typename Aggregate::value_type>;
+		{ Aggregate::combine( value, value ) } -> std::convertible_to<typename Aggregate::value_type>;
+	};
+
+	// Default Aggregate, only the subtree count is kept
+	struct no_aggregate {
+		struct value_type {};
 
+		static constexpr value_type identity()noexcept {
+			return {};
+		}
+		template<typename Object>
+		static constexpr value_type lift( Object const& )noexcept {
+			return {};
+		}
+		static constexpr value_type combine( value_type, value_type )noexcept {
+			return {};
+		}
+	};
+
+	// Quadtree holding the objects themselves.  Each node caches the bounds get_rect gave for its
+	// objects when they were stored, and every query reads those rather than calling get_rect, so
+	// objects moved in place are found where they were until refresh_bounds.
 	template<
 		std::size_t allowed_objects_per_node,
 		typename RectTraits,
 		typename VecTraits,
-		typename Object>
+		typename Object,
+		typename Aggregate = no_aggregate,
+		typename BoundsColumns = rect_columns<RectTraits>>
 		class qtree {
+			static_assert( subtree_aggregate<Aggregate, Object>, "Aggregate must provide identity, lift and combine" );
 		public:
 			using rect_traits = RectTraits;
 			using vec_traits = VecTraits;
 
 			using rect_type = typename rect_traits::rect_type;
 			using vec_type = typename vec_traits::vector_type;
+			using scalar_type = typename rect_traits::scalar_type;
 
 			using value_type = Object;
 			using pointer = Object*;
 			using reference = Object&;
 			using const_pointer = Object const*;
 			using const_reference = Object const&;
+			using aggregate_type = typename Aggregate::value_type;
+			// How nodes cache element bounds, quantized_columns<RectTraits> trades an exact test on hits for half the scanned memory
+			using bounds_columns = BoundsColumns;
+			using mask_type = std::uint64_t;
+			static constexpr mask_type all_layers = ~mask_type{};
 
 			using iterator = node_iterator<qtree>;
 			using const_iterator = const_node_iterator<qtree>;
 			static constexpr std::size_t max_objects = allowed_objects_per_node;
+			// Nodes holding max_objects stop passing new objects down, so dense cells that can't split
+			// grow past it.  Once one holds this many its cached bounds are kept sorted by left edge,
+			// so rect and point queries only scan the part that can reach them.  m_data keeps its
+			// insertion order, pointers to objects aren't moved by the sort.
+			static constexpr std::size_t sorted_threshold = std::max( max_objects, std::size_t( 64 ) );
+
+			struct ray_hit {
+				pointer object = nullptr;
+				scalar_type t = {};
+			};
+
+			struct node_span {
+				std::span<value_type> elements;
+				bool fully_contained = false;
+			};
+			struct span_query_result {
+				std::vector<node_span> spans;
+				std::vector<pointer> hits;
+			};
 			
 
 		public:
@@ -307,10 +1104,12 @@ namespace value_qtree
 			public:
 				node( rect_type const& bounds_, node* pParent )
 					:
+					m_columns( make_columns( bounds_ ) ),
 					m_bounds( bounds_ ),
 					m_pParent( pParent )
 				{
 					m_data.reserve( max_objects );
+					m_columns.reserve( max_objects );
 				}
 
 				std::vector<value_type>& elements()noexcept {
@@ -324,25 +1123,24 @@ namespace value_qtree
 				rect_type const& bounds()const noexcept {
 					return m_bounds;
 				}
+
+				node* child( std::size_t index )noexcept {
+					return m_pChildren[ index ].get();
+				}
+				node const* child( std::size_t index )const noexcept {
+					return m_pChildren[ index ].get();
+				}
 			private:
 				using find_result = std::pair<node*, typename std::vector<value_type>::iterator>;
 				using const_find_result = std::pair<node const*, typename std::vector<value_type>::const_iterator>;
 
-				void query( rect_type const& bounds, std::vector<pointer>& contained, qtree const& tree ) {
-					if( !rect_traits::intersects( m_bounds, bounds ) ) return;
-
-					for( auto& child : m_pChildren ) {
-						if( !child ) continue;
-						child->query( bounds, contained, tree );
+				// Column types that measure against a frame, like quantized_columns, get the node's bounds
+				static bounds_columns make_columns( rect_type const& bounds_ ) {
+					if constexpr( std::is_constructible_v<bounds_columns, rect_type const&> ) {
+						return bounds_columns( bounds_ );
 					}
-
-					if( m_data.empty() )return;
-
-					contained.reserve( m_data.size() + contained.size() );
-
-					for( auto& element : m_data ) {
-						if( rect_traits::intersects( tree.get_rect( element ), bounds ) )
-							contained.push_back( &element );
+					else {
+						return bounds_columns{};
 					}
 				}
 
@@ -369,110 +1167,353 @@ namespace value_qtree
 					return rect_type{};
 				}
 
-				bool add_to_child( const_reference object, qtree& tree ) {
-					if( m_data.size() >= max_objects ) return false;
+				// Child whose quadrant contains bounds, created on demand, or nullptr if the object stays here
+				node* add_to_child( rect_type const& bounds, std::size_t version, std::vector<node*>& created ) {
+					if( m_data.size() >= max_objects ) return nullptr;
 
-					for( int index = 0; auto & child : m_pChildren ) {
-						auto quadrant = get_quadrant( index++ );
+					const auto index = rect_traits::quadrant_containing( m_bounds, bounds );
+					if( index < 0 ) return nullptr;
 
-						if( !rect_traits::contains( quadrant, tree.get_rect( object ) ) ) continue;
-						if( !child ) {
-							child = std::make_unique<node>( quadrant, this );
-							tree.nodes.push_back( child.get() );
-						}
-						child->add_object( object, tree );
-						return true;
+					return &make_child( index, version, created );
+				}
+				// New children are recorded in created, the tree's node list or a build task's own
+				node& make_child( int index, std::size_t version, std::vector<node*>& created ) {
+					auto& child = m_pChildren[ index ];
+					if( !child ) {
+						child = std::make_unique<node>( get_quadrant( index ), this );
+						created.push_back( child.get() );
+						m_local_version = version;
+					}
+					return *child;
+				}
+
+				// Takes value_type const& or value_type&&, bounds are looked up once for the whole descent
+				template<typename T>
+				void add_object( T&& object, qtree& tree ) {
+					const auto bounds = tree.get_rect( object );
+					insert( std::forward<T>( object ), bounds, tree, tree.nodes );
+					++tree.object_count;
+				}
+				// Stores object in the deepest node that takes it.  Only touches the tree through created,
+				// so build tasks can insert into disjoint subtrees at once.
+				template<typename T>
+				void insert( T&& object, rect_type const& bounds, qtree const& tree, std::vector<node*>& created ) {
+					auto* pnode = this;
+					while( auto* pchild = pnode->add_to_child( bounds, tree.generation, created ) ) {
+						pnode = pchild;
 					}
 
-					return false;
+					pnode->place( std::forward<T>( object ), bounds, tree );
+				}
+				// Stores object in this node and folds it into this node's and its ancestors' bookkeeping
+				template<typename T>
+				void place( T&& object, rect_type const& bounds, qtree const& tree ) {
+					absorb( object, tree );
+					store( std::forward<T>( object ), bounds );
+					extend_content( bounds );
+					touch( tree.generation );
 				}
 
-				void add_object( const_reference object, qtree& tree ) {
-					if( !add_to_child( object, tree ) ) {
-						m_data.push_back( object );
-						++tree.count;
+				// Appends the object, its bounds go in left edge order once the node is sorted
+				template<typename T>
+				void store( T&& object, rect_type const& bounds ) {
+					m_max_reach = std::max( m_max_reach, reach_of( bounds ) );
+					m_occupancy |= occupancy_cells<rect_traits>( m_bounds, bounds );
+					if( m_sorted ) {
+						const auto left = rect_traits::left( bounds );
+						const auto index = first_sorted( [&]( scalar_type element_left ) { return element_left > left; } );
+						m_columns.insert( index, bounds );
+						m_order.insert( m_order.begin() + index, std::uint32_t( m_data.size() ) );
+						m_data.push_back( std::forward<T>( object ) );
+						return;
 					}
+
+					m_data.push_back( std::forward<T>( object ) );
+					m_columns.push_back( bounds );
+					if( m_data.size() >= sorted_threshold ) sort_columns();
 				}
+				// Puts the cached bounds in left edge order, m_order following along.  An insertion sort,
+				// so the nearly sorted columns refresh_bounds leaves are redone without allocating.
+				void sort_columns() {
+					if( !m_sorted ) {
+						m_order.resize( m_data.size() );
+						std::iota( m_order.begin(), m_order.end(), std::uint32_t{} );
+						m_sorted = true;
+					}
 
-				bool add_to_child( value_type&& object, qtree& tree ) {
-					if( m_data.size() >= max_objects ) return false;
+					m_max_reach = scalar_type{};
+					for( std::size_t i = 0; i < m_columns.size(); ++i ) {
+						const rect_type bounds = m_columns[ i ];
+						const auto element = m_order[ i ];
+						auto j = i;
+						for( ; j > 0 && rect_traits::left( bounds ) < rect_traits::left( m_columns[ j - 1 ] ); --j ) {
+							m_columns.assign( j, m_columns[ j - 1 ] );
+							m_order[ j ] = m_order[ j - 1 ];
+						}
+						if( j != i ) {
+							m_columns.assign( j, bounds );
+							m_order[ j ] = element;
+						}
+						m_max_reach = std::max( m_max_reach, reach_of( bounds ) );
+					}
+				}
+				// Index into m_data of the element whose cached bounds are at column
+				std::size_t element_of( std::size_t column )const noexcept {
+					return m_sorted ? std::size_t( m_order[ column ] ) : column;
+				}
+				// Drops the cached bounds of m_data[ element ], call before erasing the element itself
+				void erase_column( std::size_t element ) {
+					if( !m_sorted ) {
+						m_columns.erase( element );
+						return;
+					}
 
-					for( int index = 0; auto & child : m_pChildren ) {
-						auto quadrant = get_quadrant( index++ );
+					const auto column = std::size_t( std::find( m_order.begin(), m_order.end(), std::uint32_t( element ) ) - m_order.begin() );
+					m_columns.erase( column );
+					m_order.erase( m_order.begin() + column );
+					for( auto& index : m_order ) {
+						if( index > element ) --index;
+					}
+				}
+				// Moves the elements whose cached bounds no longer fit this node's quadrant out to escaped,
+				// the rest keep their order.  Returns how many left.
+				std::size_t take_escaped( std::vector<value_type>& escaped ) {
+					std::vector<std::size_t> leaving;
+					for( std::size_t c = 0; c < m_columns.size(); ++c ) {
+						if( !rect_traits::contains( m_bounds, rect_type( m_columns[ c ] ) ) ) leaving.push_back( element_of( c ) );
+					}
 
-						if( !rect_traits::contains( quadrant, tree.get_rect( object ) ) ) continue;
-						if( !child ) 
-						{
-							child = std::make_unique<node>( quadrant, this );
-							tree.nodes.push_back( child.get() );
+					// Highest index first so the ones still to go don't shift
+					std::sort( leaving.begin(), leaving.end(), std::greater<>{} );
+					for( auto element : leaving ) {
+						escaped.push_back( std::move( m_data[ element ] ) );
+						erase_column( element );
+						m_data.erase( m_data.begin() + element );
+					}
+					return leaving.size();
+				}
+				// Smallest width that gets from an element's left edge to its right edge in scalar_type
+				// arithmetic, so left + m_max_reach >= right holds for every element despite rounding
+				static scalar_type reach_of( rect_type const& bounds )noexcept {
+					const auto left = rect_traits::left( bounds );
+					const auto right = rect_traits::right( bounds );
+					auto width = right - left;
+					if constexpr( std::is_floating_point_v<scalar_type> ) {
+						while( left + width < right ) {
+							width = std::nextafter( width, std::numeric_limits<scalar_type>::infinity() );
 						}
-						child->add_object( std::move( object ), tree );
-						return true;
 					}
+					return width;
+				}
+				// First index where pred( left edge ) turns true, pred must be monotonic over the sorted elements
+				template<typename Pred>
+				std::size_t first_sorted( Pred&& pred )const noexcept {
+					auto low = std::size_t{};
+					auto high = m_data.size();
+					while( low < high ) {
+						const auto mid = std::midpoint( low, high );
+						if( pred( rect_traits::left( m_columns[ mid ] ) ) ) high = mid;
+						else low = mid + 1;
+					}
+					return low;
+				}
+				// Elements that can reach [low, high] on the x axis, a few extra at the ends but never
+				// fewer.  Only sorted nodes narrow it down.
+				std::pair<std::size_t, std::size_t> x_range( scalar_type low, scalar_type high )const noexcept {
+					if( !m_sorted ) return { std::size_t{}, m_data.size() };
+
+					return {
+						first_sorted( [&]( scalar_type left ) { return left + m_max_reach >= low; } ),
+						first_sorted( [&]( scalar_type left ) { return left > high; } )
+					};
+				}
 
-					return false;
+				// False when rect shares no occupied cell with this node's elements, so none of them can intersect it
+				bool occupied( rect_type const& rect )const noexcept {
+					return m_occupancy != 0 && ( m_occupancy & occupancy_cells<rect_traits>( m_bounds, rect ) ) != 0;
+				}
+				void refresh_occupancy()noexcept {
+					m_occupancy = 0;
+					for( std::size_t i = 0; i < m_columns.size(); ++i ) {
+						m_occupancy |= occupancy_cells<rect_traits>( m_bounds, m_columns[ i ] );
+					}
 				}
 
-				void add_object( value_type&& object, qtree& tree ) {
-					if( !add_to_child( std::move( object ), tree ) ) {
-						m_data.emplace_back( std::move( object ) );
-						++tree.count;
+				// Calls function( bounds, element ) for each element with the bounds cached for it
+				template<typename Function>
+				void for_each_cached( Function&& function ) {
+					for( std::size_t c = 0; c < m_columns.size(); ++c ) {
+						function( rect_type( m_columns[ c ] ), m_data[ element_of( c ) ] );
+					}
+				}
+				template<typename Function>
+				void for_each_cached( Function&& function )const {
+					for( std::size_t c = 0; c < m_columns.size(); ++c ) {
+						function( rect_type( m_columns[ c ] ), m_data[ element_of( c ) ] );
 					}
 				}
 
-				find_result find_object( const_reference object, rect_type const& obj_bounds ) {
-					auto is_same = [&]( const_reference data_ ) { return &data_ == &object; };
-					auto it = std::find_if( m_data.begin(), m_data.end(), is_same );
+				// Cached bounds of everything in this subtree, kept exact by every change to the tree so
+				// queries only read them.  Only meaningful while m_subtree_count isn't zero.
+				rect_type const& content()const noexcept {
+					return m_content;
+				}
+				bool content_intersects( rect_type const& rect )const noexcept {
+					return m_subtree_count != 0 && rect_traits::intersects( content(), rect );
+				}
+				bool content_contains( vec_type const& point )const noexcept {
+					return m_subtree_count != 0 && rect_traits::template contains<vec_traits>( content(), point );
+				}
 
-					if( it != m_data.end() ) return { this, it };
+				// Grows this node and its ancestors around a newly stored object's bounds, call after absorb
+				void extend_content( rect_type const& bounds )noexcept {
+					for( auto* pnode = this; pnode != nullptr; pnode = pnode->m_pParent ) {
+						if( pnode->m_content_stale ) continue;
+						pnode->m_content = pnode->m_subtree_count == 1 ? bounds : merged( pnode->m_content, bounds );
+					}
+				}
+				// Content can only shrink, so it is refit once at the end of the change rather than per removal
+				void mark_content_stale()noexcept {
+					for( auto* pnode = this; pnode != nullptr && !pnode->m_content_stale; pnode = pnode->m_pParent ) {
+						pnode->m_content_stale = true;
+					}
+				}
+				// Refits the stale part of this subtree, children before their parents
+				void refit_content() {
+					if( !m_content_stale ) return;
+
+					std::vector<node*> stale;
+					traversal_stack<node*> pending;
+					pending.push( this );
+					while( !pending.empty() ) {
+						auto* pnode = pending.pop();
+						stale.push_back( pnode );
+						for( auto& child : pnode->m_pChildren ) {
+							if( child && child->m_content_stale ) pending.push( child.get() );
+						}
+					}
 
-					for( int index = 0; auto & child : m_pChildren ) {
-						if( !child ) continue;
-						if( !rect_traits::intersects( child->bounds(), obj_bounds ) )continue;
+					for( auto it = stale.rbegin(); it != stale.rend(); ++it ) {
+						auto& current = **it;
+						auto first = true;
+						auto merge = [&]( rect_type const& rect ) {
+							current.m_content = first ? rect : merged( current.m_content, rect );
+							first = false;
+						};
+						for( std::size_t i = 0; i < current.m_columns.size(); ++i ) {
+							merge( current.m_columns[ i ] );
+						}
+						for( auto& child : current.m_pChildren ) {
+							if( child && child->m_subtree_count != 0 ) merge( child->m_content );
+						}
+						current.m_content_stale = false;
+					}
+				}
+				static rect_type merged( rect_type const& lhs, rect_type const& rhs )noexcept {
+					return rect_traits::construct(
+						std::min( rect_traits::left( lhs ), rect_traits::left( rhs ) ),
+						std::min( rect_traits::top( lhs ), rect_traits::top( rhs ) ),
+						std::max( rect_traits::right( lhs ), rect_traits::right( rhs ) ),
+						std::max( rect_traits::bottom( lhs ), rect_traits::bottom( rhs ) )
+					);
+				}
 
-						auto result = child->find_object( object, obj_bounds );
-						if( result.first != nullptr ) return result;
+				// Folds a newly stored object into the summaries of this node and its ancestors
+				void absorb( const_reference object, qtree const& tree ) {
+					const auto lifted = aggregate_type( Aggregate::lift( object ) );
+					const auto mask = tree.layers_of( object );
+					m_local_summary = Aggregate::combine( m_local_summary, lifted );
+					m_local_mask |= mask;
+					for( auto* pnode = this; pnode != nullptr; pnode = pnode->m_pParent ) {
+						++pnode->m_subtree_count;
+						pnode->m_summary = Aggregate::combine( pnode->m_summary, lifted );
+						pnode->m_subtree_mask |= mask;
 					}
+				}
 
-					return { nullptr, m_data.end() };
+				// Stamps this node and its ancestors so cached queries that saw them know to run again
+				void touch( std::size_t version )noexcept {
+					m_local_version = version;
+					for( auto* pnode = this; pnode != nullptr; pnode = pnode->m_pParent ) {
+						pnode->m_subtree_version = version;
+					}
+				}
+
+				// Rebuilds this node's own summary after one of its elements was removed
+				void refresh_local_summary( qtree const& tree ) {
+					m_local_summary = Aggregate::identity();
+					m_local_mask = mask_type{};
+					for( auto const& element : m_data ) {
+						m_local_summary = Aggregate::combine( m_local_summary, Aggregate::lift( element ) );
+						m_local_mask |= tree.layers_of( element );
+					}
+				}
+
+				// Recombines subtree summaries from this node up to the root
+				void refresh_subtree_summaries() {
+					for( auto* pnode = this; pnode != nullptr; pnode = pnode->m_pParent ) {
+						pnode->m_subtree_count = pnode->m_data.size();
+						pnode->m_summary = pnode->m_local_summary;
+						pnode->m_subtree_mask = pnode->m_local_mask;
+						for( auto& child : pnode->m_pChildren ) {
+							if( !child ) continue;
+							pnode->m_subtree_count += child->m_subtree_count;
+							pnode->m_summary = Aggregate::combine( pnode->m_summary, child->m_summary );
+							pnode->m_subtree_mask |= child->m_subtree_mask;
+						}
+					}
+				}
+
+				find_result find_object( const_reference object, rect_type const& obj_bounds ) {
+					return find_in( *this, object, obj_bounds );
 				}
 
 				const_find_result find_object( const_reference object, rect_type const& obj_bounds )const {
-					auto is_same = [&]( const_reference data_ ) { return &data_ == &object; };
-					auto it = std::find_if( m_data.begin(), m_data.end(), is_same );
+					return find_in( *this, object, obj_bounds );
+				}
 
-					if( it != m_data.end() ) return { this, it };
+				// Searches the nodes overlapping obj_bounds for the element stored at object's address
+				template<typename Node>
+				static auto find_in( Node& start, const_reference object, rect_type const& obj_bounds ) {
+					using result_type = std::pair<Node*, decltype( start.m_data.begin() )>;
+					auto is_same = [&]( const_reference data_ ) { return &data_ == &object; };
 
-					for( int index = 0; auto & child : m_pChildren ) {
-						if( !child ) continue;
-						if( !rect_traits::intersects( child->bounds(), obj_bounds ) )continue;
+					traversal_stack<Node*> pending;
+					pending.push( &start );
+					while( !pending.empty() ) {
+						auto* pnode = pending.pop();
+						auto it = std::find_if( pnode->m_data.begin(), pnode->m_data.end(), is_same );
+						if( it != pnode->m_data.end() ) return result_type{ pnode, it };
 
-						auto result = child->find_object( object, obj_bounds );
-						if( result.first != nullptr ) return result;
+						push_children( pending, *pnode, rect_traits::quadrants_intersecting( pnode->bounds(), obj_bounds ) );
 					}
 
-					return { nullptr, m_data.end() };
+					return result_type{ nullptr, start.m_data.end() };
 				}
 
 				node* find_node( rect_type const& obj_bounds ) {
-					for( auto& child : m_pChildren ) {
-						if( !child ) continue;
-						if( !rect_traits::intersects( child->bounds(), obj_bounds ) ) continue;
-						return child->find_node( obj_bounds );
-					}
-
-					return this;
+					return find_deepest( *this, obj_bounds );
 				}
 
 				node const* find_node( rect_type const& obj_bounds )const {
-					for( auto& child : m_pChildren ) {
-						if( !child ) continue;
-						if( !rect_traits::intersects( child->bounds(), obj_bounds ) ) continue;
-						auto result = child->find_node( obj_bounds );
-						if( result )return result;
+					return find_deepest( *this, obj_bounds );
+				}
+
+				// Follows the first child overlapping obj_bounds at each level
+				template<typename Node>
+				static Node* find_deepest( Node& start, rect_type const& obj_bounds ) {
+					auto* pnode = &start;
+					for( auto* pnext = pnode; pnext != nullptr; ) {
+						pnode = pnext;
+						pnext = nullptr;
+						for( auto& child : pnode->m_pChildren ) {
+							if( !child || !rect_traits::intersects( child->bounds(), obj_bounds ) ) continue;
+							pnext = child.get();
+							break;
+						}
 					}
 
-					return this;
+					return pnode;
 				}
 
 				auto is_leaf()const {
@@ -493,10 +1534,99 @@ namespace value_qtree
 				template<typename TreeType> 
 				friend class const_tree_iterator;
 
+				template<typename TreeA, typename TreeB>
+				friend class tree_join;
+
 				std::array<std::unique_ptr<node>, 4> m_pChildren;
 				std::vector<value_type> m_data;
+				// Bounds of m_data as they were when each object was stored
+				bounds_columns m_columns;
+				// Set once the node reaches sorted_threshold, then m_columns stays in left edge order
+				// and m_order holds the m_data index of each column
+				bool m_sorted = false;
+				std::vector<std::uint32_t> m_order;
+				scalar_type m_max_reach = scalar_type{};
+				// 8x8 grid over m_bounds, a bit is set while any element's cached bounds touch that cell
+				std::uint64_t m_occupancy = std::uint64_t{};
+				// Union of the cached bounds in this subtree, tighter than m_bounds for clustered objects
+				rect_type m_content = {};
+				bool m_content_stale = false;
 				rect_type m_bounds;
 				node* m_pParent = nullptr;
+				std::size_t m_subtree_count = std::size_t{};
+				aggregate_type m_local_summary = Aggregate::identity();
+				aggregate_type m_summary = Aggregate::identity();
+				mask_type m_local_mask = mask_type{};
+				mask_type m_subtree_mask = mask_type{};
+				// Tree generation of the last change to this node's elements or children, and to its subtree
+				std::size_t m_local_version = std::size_t{};
+				std::size_t m_subtree_version = std::size_t{};
+			};
+
+			// Where a budgeted query stopped.  Only good until the tree is next modified.
+			class query_cursor {
+			public:
+				bool done()const noexcept {
+					return m_done;
+				}
+			private:
+				friend class qtree;
+				rect_type m_bounds = {};
+				traversal_stack<node*> m_pending;
+				node* m_pcurrent = nullptr;
+				std::size_t m_next_element = std::size_t{};
+				std::size_t m_generation = std::size_t{};
+				qtree const* m_ptree = nullptr;
+				bool m_done = true;
+			};
+			struct budgeted_result {
+				std::vector<pointer> objects;
+				query_cursor cursor;
+			};
+
+			// A rect query kept between calls.  Running it again only rechecks the version stamps of
+			// the nodes it visited last time and hands back the stored result if none changed.
+			// Objects moved without being reinserted aren't seen, the same as for the tree itself.
+			class cached_query {
+			public:
+				cached_query() = default;
+				explicit cached_query( rect_type const& bounds_ )
+					:
+					m_bounds( bounds_ )
+				{}
+
+				rect_type const& bounds()const noexcept {
+					return m_bounds;
+				}
+				// A different region throws away the stored result
+				void set_bounds( rect_type const& bounds_ )noexcept {
+					if( rect_traits::left( bounds_ ) == rect_traits::left( m_bounds ) &&
+						rect_traits::top( bounds_ ) == rect_traits::top( m_bounds ) &&
+						rect_traits::right( bounds_ ) == rect_traits::right( m_bounds ) &&
+						rect_traits::bottom( bounds_ ) == rect_traits::bottom( m_bounds ) )
+						return;
+
+					m_bounds = bounds_;
+					m_ptree = nullptr;
+				}
+				std::vector<pointer> const& objects()const noexcept {
+					return m_objects;
+				}
+			private:
+				friend class qtree;
+
+				// whole nodes were inside the query, their subtree version is checked instead of their own
+				struct visit {
+					node const* pnode = nullptr;
+					std::size_t version = std::size_t{};
+					bool whole = false;
+				};
+
+				rect_type m_bounds = {};
+				std::vector<visit> m_visits;
+				std::vector<pointer> m_objects;
+				qtree const* m_ptree = nullptr;
+				std::size_t m_generation = std::size_t{};
 			};
 
 			qtree( rect_type const& bounds_, std::function<rect_type( value_type const& )> get_rect_fn )
@@ -507,25 +1637,57 @@ namespace value_qtree
 				nodes.reserve( 256 );
 				nodes.push_back( &root );
 			}
+			// get_mask_fn returns the layers an object belongs to, each node keeps the OR of its subtree
+			qtree( rect_type const& bounds_, std::function<rect_type( value_type const& )> get_rect_fn, std::function<mask_type( value_type const& )> get_mask_fn )
+				:
+				qtree( bounds_, std::move( get_rect_fn ) )
+			{
+				get_mask = std::move( get_mask_fn );
+			}
 
 			void push( value_type const& object ) {
+				++generation;
 				root.add_object( object, *this );
 			}
 			void push( value_type&& object ) {
+				++generation;
 				root.add_object( std::move( object ), *this );
 			}
 
 			template<typename...Args>
 			void emplace( Args&&... args ) {
+				++generation;
 				root.add_object( value_type{ std::forward<Args>( args )... }, *this);
 			}
 
+			// Replaces the contents with objects, building the same nodes, iterated in the same order,
+			// as pushing them in order.  The subtrees under the root's quadrants, or deeper ones for
+			// large inputs, are each built on one of pool's threads, so get_rect and get_mask are
+			// called from them too.  The tree is left empty if anything throws.
+			void build( std::vector<value_type> objects, thread_pool& pool = thread_pool::shared() ) {
+				clear();
+
+				try {
+					build_parts( objects, pool );
+				}
+				catch( ... ) {
+					clear();
+					throw;
+				}
+			}
+
 			void clear()noexcept {
+				++generation;
 				root = node( root.m_bounds, nullptr );
+				nodes.resize( 1 );
+				object_count = std::size_t{};
+				root.touch( generation );
 			}
 
 			iterator begin()noexcept {
-				return iterator( this, nodes.begin(), (*nodes.begin())->m_data.begin() );
+				auto node_it = std::find_if( nodes.begin(), nodes.end(), []( node const* pnode ) { return !pnode->m_data.empty(); } );
+				if( node_it == nodes.end() ) return end();
+				return iterator( this, node_it, ( *node_it )->m_data.begin() );
 			}
 			iterator end()noexcept {
 				auto end_node = nodes.end() - 1;
@@ -533,42 +1695,413 @@ namespace value_qtree
 			}
 
 			const_iterator begin()const noexcept {
-				return const_iterator( this, nodes.begin(), ( *nodes.begin() )->m_data.begin() );
+				auto node_it = std::find_if( nodes.begin(), nodes.end(), []( node const* pnode ) { return !pnode->m_data.empty(); } );
+				if( node_it == nodes.end() ) return end();
+				return const_iterator( this, node_it, ( *node_it )->m_data.begin() );
 			}
 			const_iterator end()const noexcept {
 				auto end_node = nodes.end() - 1;
 				return const_iterator( this, nodes.end(), ( *end_node )->m_data.end() );
 			}
 
+			// Tests the bounds cached when each object was stored, a whole node per kernel call, and only
+			// goes into subtrees whose content reaches bounds.  Call refresh_bounds after moving objects
+			// in place instead of reinserting them.
 			std::vector<pointer> query( rect_type const& bounds ) {
+				return query_in( *this, bounds );
+			}
+			// The const read paths change nothing, so any number of threads may run them at once while
+			// nothing modifies the tree.
+			std::vector<const_pointer> query( rect_type const& bounds )const {
+				return query_in( *this, bounds );
+			}
+
+			// Same as query( bounds ) but stops once budget runs out.  If cursor isn't done
+			// the rest of the results can be had with resume, for example on the next frame.
+			budgeted_result query( rect_type const& bounds, query_budget const& budget ) {
+				budgeted_result result;
+				auto& cursor = result.cursor;
+				cursor.m_bounds = bounds;
+				cursor.m_generation = generation;
+				cursor.m_ptree = this;
+				cursor.m_done = false;
+				if( root.content_intersects( bounds ) )
+					cursor.m_pending.push( &root );
+
+				run_cursor( cursor, budget, result.objects );
+				return result;
+			}
+
+			// Runs cache's query, or returns its stored result if nothing it depends on has changed
+			std::vector<pointer> const& query( cached_query& cache ) {
+				if( cache.m_ptree == this && ( cache.m_generation == generation || is_current( cache ) ) ) {
+					cache.m_generation = generation;
+					return cache.m_objects;
+				}
+
+				auto const& bounds = cache.m_bounds;
+				cache.m_visits.clear();
+				cache.m_objects.clear();
+				cache.m_ptree = this;
+				cache.m_generation = generation;
+				if( !root.content_intersects( bounds ) ) return cache.m_objects;
+
+				// Popped parents are recorded before their children, is_current relies on that order
+				traversal_stack<node*> pending;
+				pending.push( &root );
+				while( !pending.empty() ) {
+					auto* pnode = pending.pop();
+
+					// Only the root can hold objects that stick out of its bounds
+					if( pnode->m_pParent != nullptr && rect_traits::contains( bounds, pnode->m_bounds ) ) {
+						cache.m_visits.push_back( { pnode, pnode->m_subtree_version, true } );
+						walk_tree( *pnode,
+							[&]( node& current ) {
+								for( auto& element : current.m_data ) {
+									cache.m_objects.push_back( &element );
+								}
+								return all_children;
+							}
+						);
+						continue;
+					}
+
+					cache.m_visits.push_back( { pnode, pnode->m_local_version, false } );
+					pnode->for_each_cached( [&]( rect_type const& element_bounds, value_type& element ) {
+						if( rect_traits::intersects( element_bounds, bounds ) )
+							cache.m_objects.push_back( &element );
+					} );
+					push_children( pending, *pnode, rect_traits::quadrants_intersecting( pnode->bounds(), bounds ) );
+				}
+
+				return cache.m_objects;
+			}
+
+			// Continues a budgeted query within a new budget, returning the objects found in this slice.
+			// Throws if the tree was modified after the query was started.
+			std::vector<pointer> resume( query_cursor& cursor, query_budget const& budget ) {
+				std::vector<pointer> objects;
+				run_cursor( cursor, budget, objects );
+				return objects;
+			}
+
+			// Objects in any of the given layers whose cached bounds intersect bounds.
+			// Subtrees with no objects in those layers are skipped.
+			std::vector<pointer> query( rect_type const& bounds, mask_type layers ) {
+				auto wanted = [&]( mask_type mask ) { return ( mask & layers ) != mask_type{}; };
+
+				std::vector<pointer> objects;
+				if( !wanted( root.m_subtree_mask ) || !root.content_intersects( bounds ) ) return objects;
+
+				walk_tree( root,
+					[&]( node& current ) {
+						if( wanted( current.m_local_mask ) ) {
+							current.for_each_cached( [&]( rect_type const& element_bounds, value_type& element ) {
+								if( wanted( layers_of( element ) ) && rect_traits::intersects( element_bounds, bounds ) )
+									objects.push_back( &element );
+							} );
+						}
+
+						return
+							rect_traits::quadrants_intersecting( current.bounds(), bounds ) &
+							children_where( current, [&]( node const& child ) { return wanted( child.m_subtree_mask ); } );
+					}
+				);
+				return objects;
+			}
+
+			// Objects overlapping any shape satisfying query_shape, such as convex_polygon,
+			// rotated_rect or view_frustum.  Nodes fully inside the shape are taken whole.
+			template<query_shape<RectTraits> Shape>
+			std::vector<pointer> query( Shape const& shape ) {
 				std::vector<pointer> objects;
-				root.query( bounds, objects, *this );
+				if( root.m_subtree_count == 0 || shape.classify( root.content() ) == shape_overlap::outside ) return objects;
+
+				// Second is set once a node is inside the shape, its subtree is then taken untested.
+				// The root never is since it may hold objects that stick out of its bounds.
+				traversal_stack<std::pair<node*, bool>> pending;
+				pending.push( { &root, false } );
+				while( !pending.empty() ) {
+					const auto [pnode, inside] = pending.pop();
+					pnode->for_each_cached( [&]( rect_type const& element_bounds, value_type& element ) {
+						if( inside || shape.intersects( element_bounds ) )
+							objects.push_back( &element );
+					} );
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto overlap = inside ? shape_overlap::inside : shape.classify( child->bounds() );
+						if( overlap != shape_overlap::outside )
+							pending.push( { child.get(), overlap == shape_overlap::inside } );
+					}
+				}
 				return objects;
 			}
 
+			// Like query, but nodes the query fully covers come back whole as spans over their
+			// elements with no per element tests.  Partly covered nodes are handled per mode.
+			span_query_result query_spans( rect_type const& bounds, partial_nodes mode = partial_nodes::filter ) {
+				span_query_result result;
+				if( !root.content_intersects( bounds ) ) return result;
+
+				// Second is set for nodes inside bounds, never the root for the same reason as above
+				traversal_stack<std::pair<node*, bool>> pending;
+				pending.push( { &root, false } );
+				while( !pending.empty() ) {
+					const auto [pnode, contained] = pending.pop();
+					if( !pnode->m_data.empty() ) {
+						if( contained || mode == partial_nodes::defer ) {
+							result.spans.push_back( { std::span<value_type>( pnode->m_data ), contained } );
+						}
+						else {
+							pnode->for_each_cached( [&]( rect_type const& element_bounds, value_type& element ) {
+								if( rect_traits::intersects( element_bounds, bounds ) )
+									result.hits.push_back( &element );
+							} );
+						}
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+						if( contained )
+							pending.push( { child.get(), true } );
+						else if( rect_traits::intersects( child->bounds(), bounds ) )
+							pending.push( { child.get(), rect_traits::contains( bounds, child->bounds() ) } );
+					}
+				}
+				return result;
+			}
+
+			// Runs every query in one descent of the tree.  Queries are Morton ordered so
+			// neighbours share node visits; sink( query_index, pointer ) is called for each hit.
+			template<typename Sink>
+			void query_batch( std::span<rect_type const> queries, Sink&& sink ) {
+				batch_in( *this, queries, batch_order( queries ), sink );
+			}
+			template<typename Sink>
+			void query_batch( std::span<rect_type const> queries, Sink&& sink )const {
+				batch_in( *this, queries, batch_order( queries ), sink );
+			}
+
+			// query_batch spread over pool.  The Morton ordered queries are cut into one slice per sink
+			// and sinks[ slice ]( query_index, const_pointer ) gets that slice's hits, so each sink is
+			// only ever called from one thread at a time.
+			template<typename Sink>
+			void parallel_query_batch( std::span<rect_type const> queries, std::vector<Sink>& sinks, thread_pool& pool = thread_pool::shared() )const {
+				if( sinks.empty() )
+					throw std::invalid_argument( "parallel_query_batch needs at least one sink" );
+
+				const auto order = batch_order( queries );
+				const auto slice = ( order.size() + sinks.size() - 1 ) / sinks.size();
+				pool.run( sinks.size(), [&]( std::size_t index ) {
+					const auto first = std::min( index * slice, order.size() );
+					const auto last = std::min( first + slice, order.size() );
+					batch_in( *this, queries, std::vector<std::size_t>( order.begin() + first, order.begin() + last ), sinks[ index ] );
+				} );
+			}
+
+			// Calls callback( lhs, rhs ) once for every pair of objects whose bounds intersect.
+			// Each node's elements are tested against each other and against its descendants.
+			// Pairs are found from the bounds cached at insert, objects moved in place since then
+			// need a refresh_bounds first or they are paired where they used to be.
+			template<typename Callback>
+			void for_each_overlapping_pair( Callback&& callback ) {
+				// candidates[ first, last ) holds elements from ancestors whose bounds overlap pnode
+				struct pending_node {
+					node* pnode = nullptr;
+					std::size_t first = {}, last = {};
+				};
+				std::vector<std::pair<rect_type, pointer>> candidates;
+				std::vector<std::size_t> nearby;
+				traversal_stack<pending_node> pending;
+				pending.push( { &root, std::size_t{}, std::size_t{} } );
+				while( !pending.empty() ) {
+					const auto [pnode, first, last] = pending.pop();
+					candidates.resize( last );
+
+					// Ancestor elements sharing no occupied cell with this node can't hit any of its elements
+					nearby.clear();
+					for( auto i = first; i < last; ++i ) {
+						if( pnode->occupied( candidates[ i ].first ) ) nearby.push_back( i );
+					}
+
+					for( std::size_t c = 0; c < pnode->m_columns.size(); ++c ) {
+						const rect_type element_bounds = pnode->m_columns[ c ];
+						auto& element = pnode->m_data[ pnode->element_of( c ) ];
+						for( auto i : nearby ) {
+							if( rect_traits::intersects( candidates[ i ].first, element_bounds ) )
+								callback( *candidates[ i ].second, element );
+						}
+						for( auto i = last; i < candidates.size(); ++i ) {
+							if( rect_traits::intersects( candidates[ i ].first, element_bounds ) )
+								callback( *candidates[ i ].second, element );
+						}
+
+						// Later elements of this node are tested against this one as they are added
+						candidates.emplace_back( element_bounds, &element );
+					}
+
+					const auto node_last = candidates.size();
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child || child->m_subtree_count == 0 ) continue;
+
+						const auto child_first = candidates.size();
+						for( auto i = first; i < node_last; ++i ) {
+							if( child->content_intersects( candidates[ i ].first ) )
+								candidates.push_back( candidates[ i ] );
+						}
+						pending.push( { child.get(), child_first, candidates.size() } );
+					}
+				}
+			}
+
+			// Objects whose cached bounds touch the circle at center with the given radius
+			std::vector<pointer> query_radius( vec_type const& center, scalar_type radius ) {
+				return radius_in( *this, center, radius );
+			}
+			std::vector<const_pointer> query_radius( vec_type const& center, scalar_type radius )const {
+				return radius_in( *this, center, radius );
+			}
+
+			// Calls visitor( object ) for every object whose cached bounds contain point, visitor may return
+			// false to stop.  Only the child holding point is followed at each level, so there are no node
+			// tests off that path and nothing is allocated.
+			template<typename Visitor>
+			void query_point( vec_type const& point, Visitor&& visitor ) {
+				point_in( *this, point, visitor );
+			}
+			template<typename Visitor>
+			void query_point( vec_type const& point, Visitor&& visitor )const {
+				point_in( *this, point, visitor );
+			}
+
+			// The k objects nearest to point, closest first.  Distance is measured to each object's cached bounds.
+			std::vector<pointer> nearest( vec_type const& point, std::size_t k ) {
+				return nearest_in( *this, point, k, std::numeric_limits<scalar_type>::max() );
+			}
+			std::vector<pointer> nearest( vec_type const& point, std::size_t k, scalar_type max_distance ) {
+				return nearest_in( *this, point, k, max_distance * max_distance );
+			}
+			std::vector<const_pointer> nearest( vec_type const& point, std::size_t k )const {
+				return nearest_in( *this, point, k, std::numeric_limits<scalar_type>::max() );
+			}
+			std::vector<const_pointer> nearest( vec_type const& point, std::size_t k, scalar_type max_distance )const {
+				return nearest_in( *this, point, k, max_distance * max_distance );
+			}
+
+			// Objects hit by origin + ( direction * t ) for t in [0, max_t], nearest first.
+			// Nodes are visited front to back so first_hit stops as soon as nothing closer can remain.
+			std::vector<ray_hit> raycast( vec_type const& origin, vec_type const& direction, scalar_type max_t, raycast_mode mode = raycast_mode::first_hit ) {
+				using node_entry = std::pair<scalar_type, node*>;
+				auto farther = []( auto const& lhs, auto const& rhs ) { return lhs.first > rhs.first; };
+				auto nearer = []( ray_hit const& lhs, ray_hit const& rhs ) { return lhs.t < rhs.t; };
+
+				std::priority_queue<node_entry, std::vector<node_entry>, decltype( farther )> pending( farther );
+				std::vector<ray_hit> hits;
+				auto limit = [&] {
+					return ( mode == raycast_mode::first_hit && !hits.empty() ) ? hits.front().t : max_t;
+				};
+
+				// Root may hold objects outside its bounds, so always visit it
+				pending.push( { scalar_type( 0 ), &root } );
+				while( !pending.empty() && pending.top().first <= limit() ) {
+					auto* pnode = pending.top().second;
+					pending.pop();
+
+					pnode->for_each_cached( [&]( rect_type const& element_bounds, value_type& element ) {
+						const auto t = rect_traits::template ray_entry<vec_traits>( element_bounds, origin, direction, limit() );
+						if( !t ) return;
+
+						if( mode == raycast_mode::all_hits ) {
+							hits.push_back( { &element, *t } );
+						}
+						else if( hits.empty() || *t < hits.front().t ) {
+							hits.assign( 1, { &element, *t } );
+						}
+					} );
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto t = rect_traits::template ray_entry<vec_traits>( child->bounds(), origin, direction, limit() );
+						if( t ) pending.push( { *t, child.get() } );
+					}
+				}
+
+				std::sort( hits.begin(), hits.end(), nearer );
+				return hits;
+			}
+
+			// Objects touched by moving as it travels by displacement, earliest time of impact first.
+			// t is the fraction of displacement travelled, 0 for objects moving already touches.
+			std::vector<ray_hit> query_swept( rect_type const& moving, vec_type const& displacement ) {
+				auto entry = [&]( rect_type const& bounds ) {
+					return rect_traits::template swept_entry<vec_traits>( moving, displacement, bounds );
+				};
+
+				std::vector<ray_hit> hits;
+				if( root.m_subtree_count == 0 || !entry( root.content() ) ) return hits;
+
+				walk_tree( root,
+					[&]( node& current ) {
+						current.for_each_cached( [&]( rect_type const& element_bounds, value_type& element ) {
+							if( auto t = entry( element_bounds ) )
+								hits.push_back( { &element, *t } );
+						} );
+						return children_where( current, [&]( node const& child ) { return entry( child.bounds() ).has_value(); } );
+					}
+				);
+				std::sort( hits.begin(), hits.end(), []( ray_hit const& lhs, ray_hit const& rhs ) { return lhs.t < rhs.t; } );
+				return hits;
+			}
+
 			iterator erase( const_iterator where ) {
 				const auto& self = *this;
 				if( where == self.end() ) {
 					throw std::runtime_error( "cannot delete end iterator" );
 				}
 
-				auto it = ( *where.current_node )->elements().erase( where.it );
-
-				if( ( *where.current_node )->is_leaf() &&
-					( *where.current_node )->elements().empty() ) {
-					auto parent = ( *where.current_node )->m_pParent;
+				++generation;
+				auto* pnode = *where.current_node;
+				auto dist = std::distance( self.nodes.begin(), where.current_node );
+				auto obj_dist = std::distance( pnode->elements().cbegin(), where.it );
+
+				pnode->erase_column( std::size_t( obj_dist ) );
+				pnode->elements().erase( where.it );
+				pnode->refresh_occupancy();
+				pnode->mark_content_stale();
+				pnode->refresh_local_summary( *this );
+				--object_count;
+
+				// Empty leaves are dropped, the root always stays
+				if( pnode->m_pParent != nullptr && pnode->is_leaf() && pnode->elements().empty() ) {
+					auto parent = pnode->m_pParent;
+					nodes.erase( nodes.begin() + dist );
 					for( auto& child : parent->m_pChildren ) {
-						if( child.get() == ( *where.current_node ) ) {
-							where.current_node = nodes.erase( where.current_node );
+						if( child.get() == pnode ) {
 							child = std::unique_ptr<node>{};
 						}
 					}
+					parent->refresh_subtree_summaries();
+					parent->touch( generation );
+					obj_dist = 0;
+				}
+				else {
+					pnode->refresh_subtree_summaries();
+					pnode->touch( generation );
 				}
+				root.refit_content();
 
-				auto dist = std::distance( self.nodes.begin(), where.current_node );
+				// Land on the next element, skipping past nodes that have none left
 				auto node_it = nodes.begin() + dist;
-				--count;
-				return iterator{ this, node_it, it };
+				while( node_it != nodes.end() && std::size_t( obj_dist ) >= ( *node_it )->elements().size() ) {
+					++node_it;
+					obj_dist = 0;
+				}
+				if( node_it == nodes.end() ) return end();
+
+				return iterator{ this, node_it, ( *node_it )->elements().begin() + obj_dist };
 			}
 
 			iterator erase( const_iterator from, const_iterator to ) {
@@ -604,10 +2137,387 @@ namespace value_qtree
 				return { this, node_it, obj_it };
 			}
 			auto size()const noexcept {
-				return count;
+				return object_count;
+			}
+
+			// Reloads the cached bounds every query tests from get_rect, for objects that moved without
+			// being reinserted, along with the occupancy and content bounds nodes are skipped by.
+			// Objects that left their node's quadrant are taken out and pushed again, so pointers to
+			// those don't stay valid.  Cached queries see this as a change everywhere.
+			void refresh_bounds() {
+				++generation;
+				std::vector<value_type> escaped;
+				std::vector<node*> shrunk;
+				for( auto* pnode : nodes ) {
+					for( std::size_t i = 0; i < pnode->m_columns.size(); ++i ) {
+						pnode->m_columns.assign( i, get_rect( pnode->m_data[ pnode->element_of( i ) ] ) );
+					}
+					// The root holds whatever sticks out of the tree, nothing leaves it
+					if( pnode->m_pParent != nullptr && pnode->take_escaped( escaped ) != std::size_t{} ) {
+						pnode->refresh_local_summary( *this );
+						shrunk.push_back( pnode );
+					}
+					if( pnode->m_sorted ) pnode->sort_columns();
+					pnode->refresh_occupancy();
+					pnode->m_content_stale = true;
+					pnode->m_local_version = generation;
+					pnode->m_subtree_version = generation;
+				}
+
+				for( auto* pnode : shrunk ) {
+					pnode->refresh_subtree_summaries();
+				}
+				object_count -= escaped.size();
+				for( auto& object : escaped ) {
+					root.add_object( std::move( object ), *this );
+				}
+				root.refit_content();
+			}
+
+			// Number of objects whose cached bounds intersect bounds.  Nodes fully inside bounds
+			// answer from their subtree count without touching their elements.
+			std::size_t count( rect_type const& bounds )const {
+				auto result = std::size_t{};
+				if( !root.content_intersects( bounds ) ) return result;
+
+				walk_tree( root,
+					[&]( node const& current ) {
+						// Only the root can hold objects that stick out of its bounds
+						if( current.m_pParent != nullptr && rect_traits::contains( bounds, current.m_bounds ) ) {
+							result += current.m_subtree_count;
+							return 0u;
+						}
+
+						current.for_each_cached( [&]( rect_type const& element_bounds, value_type const& ) {
+							if( rect_traits::intersects( element_bounds, bounds ) )
+								++result;
+						} );
+						return rect_traits::quadrants_intersecting( current.bounds(), bounds );
+					}
+				);
+				return result;
+			}
+
+			// Aggregate folded over the objects whose cached bounds intersect bounds
+			aggregate_type aggregate( rect_type const& bounds )const {
+				auto result = aggregate_type( Aggregate::identity() );
+				if( !root.content_intersects( bounds ) ) return result;
+
+				walk_tree( root,
+					[&]( node const& current ) {
+						if( current.m_pParent != nullptr && rect_traits::contains( bounds, current.m_bounds ) ) {
+							result = Aggregate::combine( result, current.m_summary );
+							return 0u;
+						}
+
+						current.for_each_cached( [&]( rect_type const& element_bounds, value_type const& element ) {
+							if( rect_traits::intersects( element_bounds, bounds ) )
+								result = Aggregate::combine( result, Aggregate::lift( element ) );
+						} );
+						return rect_traits::quadrants_intersecting( current.bounds(), bounds );
+					}
+				);
+				return result;
+			}
+			// Aggregate folded over every object in the tree
+			aggregate_type const& aggregate()const noexcept {
+				return root.m_summary;
 			}
 
 		private:
+			mask_type layers_of( const_reference object )const {
+				return get_mask ? get_mask( object ) : all_layers;
+			}
+
+			// A node is only removed after its parent's local version changes, so stopping at the
+			// first mismatch never reads a node that no longer exists
+			bool is_current( cached_query const& cache )const noexcept {
+				for( auto const& visit : cache.m_visits ) {
+					const auto version = visit.whole ? visit.pnode->m_subtree_version : visit.pnode->m_local_version;
+					if( version != visit.version ) return false;
+				}
+				return true;
+			}
+
+			void run_cursor( query_cursor& cursor, query_budget const& budget, std::vector<pointer>& found ) {
+				if( cursor.m_done ) return;
+				if( cursor.m_ptree != this || cursor.m_generation != generation )
+					throw std::runtime_error( "query cursor is stale, the tree was modified" );
+
+				auto visits = std::size_t{};
+				auto tests = std::size_t{};
+				for( ;; ) {
+					if( cursor.m_pcurrent == nullptr ) {
+						if( cursor.m_pending.empty() ) {
+							cursor.m_done = true;
+							return;
+						}
+						if( visits != std::size_t{} && ( visits >= budget.max_node_visits || budget.out_of_time() ) ) return;
+
+						++visits;
+						cursor.m_pcurrent = cursor.m_pending.pop();
+						cursor.m_next_element = std::size_t{};
+						push_children( cursor.m_pending, *cursor.m_pcurrent, rect_traits::quadrants_intersecting( cursor.m_pcurrent->bounds(), cursor.m_bounds ) );
+					}
+
+					auto& current = *cursor.m_pcurrent;
+					while( cursor.m_next_element < current.m_columns.size() ) {
+						if( tests != std::size_t{} && tests >= budget.max_element_tests ) return;
+						if( ++tests % query_budget::clock_interval == std::size_t{} && budget.out_of_time() ) return;
+
+						const auto column = cursor.m_next_element++;
+						if( rect_traits::intersects( current.m_columns[ column ], cursor.m_bounds ) )
+							found.push_back( &current.m_data[ current.element_of( column ) ] );
+					}
+					cursor.m_pcurrent = nullptr;
+				}
+			}
+
+			// Bodies shared by the const and non-const overloads, Self is qtree or qtree const
+			template<typename Self>
+			using object_pointer = std::conditional_t<std::is_const_v<Self>, const_pointer, pointer>;
+
+			template<typename Self>
+			static std::vector<object_pointer<Self>> query_in( Self& self, rect_type const& bounds ) {
+				std::vector<object_pointer<Self>> objects;
+				if( !self.root.content_intersects( bounds ) ) return objects;
+
+				std::vector<std::uint32_t> hits;
+				walk_tree( self.root,
+					[&]( auto& current ) {
+						if( current.occupied( bounds ) ) {
+							const auto [first, last] = current.x_range( rect_traits::left( bounds ), rect_traits::right( bounds ) );
+							hits.resize( last - first );
+							const auto hit_count = current.m_columns.intersecting( bounds, first, last - first, hits.data() );
+							for( std::size_t i = 0; i < hit_count; ++i ) {
+								objects.push_back( &current.m_data[ current.element_of( hits[ i ] ) ] );
+							}
+						}
+						return children_where( current, [&]( auto& child ) { return child.content_intersects( bounds ); } );
+					}
+				);
+				return objects;
+			}
+
+			// Queries in Morton order, less the ones that miss the root's content
+			std::vector<std::size_t> batch_order( std::span<rect_type const> queries )const {
+				auto order = morton_order<rect_traits>( root.bounds(), queries );
+				std::erase_if( order, [&]( std::size_t index ) {
+					return !root.content_intersects( queries[ index ] );
+				} );
+				return order;
+			}
+
+			template<typename Self, typename Sink>
+			static void batch_in( Self& self, std::span<rect_type const> queries, std::vector<std::size_t> active, Sink& sink ) {
+				if( active.empty() ) return;
+
+				// active[ first, last ) holds the queries overlapping pnode.  Anything past last
+				// belongs to a sibling subtree that is already done.
+				using node_pointer = decltype( &self.root );
+				struct pending_node {
+					node_pointer pnode = nullptr;
+					std::size_t first = {}, last = {};
+				};
+				traversal_stack<pending_node> pending;
+				pending.push( { &self.root, std::size_t{}, active.size() } );
+				while( !pending.empty() ) {
+					const auto [pnode, first, last] = pending.pop();
+					active.resize( last );
+
+					for( std::size_t c = 0; c < pnode->m_columns.size(); ++c ) {
+						const rect_type bounds = pnode->m_columns[ c ];
+						auto* pelement = &pnode->m_data[ pnode->element_of( c ) ];
+						for( auto i = first; i < last; ++i ) {
+							if( rect_traits::intersects( bounds, queries[ active[ i ] ] ) )
+								sink( active[ i ], pelement );
+						}
+					}
+
+					for( auto& child : pnode->m_pChildren ) {
+						if( !child ) continue;
+
+						const auto child_first = active.size();
+						for( auto i = first; i < last; ++i ) {
+							if( rect_traits::intersects( child->bounds(), queries[ active[ i ] ] ) )
+								active.push_back( active[ i ] );
+						}
+						if( active.size() > child_first )
+							pending.push( { child.get(), child_first, active.size() } );
+					}
+				}
+			}
+
+			template<typename Self>
+			static std::vector<object_pointer<Self>> radius_in( Self& self, vec_type const& center, scalar_type radius ) {
+				auto touches = [&]( rect_type const& bounds ) {
+					return rect_traits::template intersects<vec_traits>( bounds, center, radius );
+				};
+
+				// Root may hold objects outside its bounds, so it is always visited
+				std::vector<object_pointer<Self>> objects;
+
+				walk_tree( self.root,
+					[&]( auto& current ) {
+						current.for_each_cached( [&]( rect_type const& element_bounds, auto& element ) {
+							if( touches( element_bounds ) )
+								objects.push_back( &element );
+						} );
+						return children_where( current, [&]( node const& child ) { return touches( child.bounds() ); } );
+					}
+				);
+				return objects;
+			}
+
+			template<typename Self, typename Visitor>
+			static void point_in( Self& self, vec_type const& point, Visitor& visitor ) {
+				const auto x = vec_traits::x( point );
+				const auto y = vec_traits::y( point );
+
+				// Elements are tested a chunk at a time so the hits fit on the stack
+				constexpr auto chunk_size = std::size_t( 64 );
+				std::uint32_t hits[ chunk_size ];
+
+				// Root may hold objects outside its bounds, so its elements are always checked
+				const auto in_bounds = rect_traits::template contains<vec_traits>( self.root.bounds(), point );
+				const auto point_rect = rect_traits::construct( x, y, x, y );
+				for( auto* pnode = &self.root; pnode != nullptr; ) {
+					const auto [begin, end] = pnode->occupied( point_rect ) ? pnode->x_range( x, x ) : std::pair<std::size_t, std::size_t>{};
+					for( auto first = begin; first < end; first += chunk_size ) {
+						const auto count = std::min( chunk_size, end - first );
+						const auto hit_count = pnode->m_columns.containing( x, y, first, count, hits );
+						for( std::size_t i = 0; i < hit_count; ++i ) {
+							auto& element = pnode->m_data[ pnode->element_of( hits[ i ] ) ];
+							if constexpr( std::is_convertible_v<std::invoke_result_t<Visitor&, decltype( element )>, bool> ) {
+								if( !visitor( element ) ) return;
+							}
+							else {
+								visitor( element );
+							}
+						}
+					}
+					if( !in_bounds ) return;
+
+					// Same quadrant order as get_quadrant, the right and bottom halves own the center lines
+					const auto center = rect_traits::template center<vec_traits>( pnode->m_bounds );
+					pnode = pnode->child( ( x < vec_traits::x( center ) ? 0 : 1 ) + ( y < vec_traits::y( center ) ? 0 : 2 ) );
+					if( pnode != nullptr && !pnode->content_contains( point ) ) return;
+				}
+			}
+
+			template<typename Self>
+			static std::vector<object_pointer<Self>> nearest_in( Self& self, vec_type const& point, std::size_t k, scalar_type max_distance_sqr ) {
+				using node_entry = std::pair<scalar_type, decltype( &self.root )>;
+				using hit_entry = std::pair<scalar_type, object_pointer<Self>>;
+				auto farther = []( auto const& lhs, auto const& rhs ) { return lhs.first > rhs.first; };
+				auto nearer = []( auto const& lhs, auto const& rhs ) { return lhs.first < rhs.first; };
+
+				// Nodes closest to point come off first, hits keeps the k best with the worst on top
+				std::priority_queue<node_entry, std::vector<node_entry>, decltype( farther )> pending( farther );
+				std::priority_queue<hit_entry, std::vector<hit_entry>, decltype( nearer )> hits( nearer );
+				auto limit = [&] { return hits.size() < k ? max_distance_sqr : hits.top().first; };
+
+				std::vector<object_pointer<Self>> result;
+				if( k == std::size_t{} ) return result;
+
+				std::vector<scalar_type> distances;
+
+				// Root may hold objects outside its bounds, so always visit it
+				pending.push( { scalar_type( 0 ), &self.root } );
+				while( !pending.empty() && pending.top().first <= limit() ) {
+					auto* pnode = pending.top().second;
+					pending.pop();
+
+					distances.resize( pnode->m_columns.size() );
+					pnode->m_columns.distances_sqr( vec_traits::x( point ), vec_traits::y( point ), distances.data() );
+					for( std::size_t i = 0; i < distances.size(); ++i ) {
+						if( distances[ i ] > limit() ) continue;
+
+						hits.push( { distances[ i ], &pnode->m_data[ pnode->element_of( i ) ] } );
+						if( hits.size() > k ) hits.pop();
+					}
+
+					for( std::size_t index = 0; index < 4; ++index ) {
+						auto* pchild = pnode->child( index );
+						if( pchild == nullptr || pchild->m_subtree_count == 0 ) continue;
+
+						const auto dist = rect_traits::template distance_sqr<vec_traits>( pchild->content(), point );
+						if( dist <= limit() ) pending.push( { dist, pchild } );
+					}
+				}
+
+				result.resize( hits.size() );
+				for( auto it = result.rbegin(); it != result.rend(); ++it ) {
+					*it = hits.top().second;
+					hits.pop();
+				}
+
+				return result;
+			}
+
+			// The upper levels are filled here, then each part is built detached from its parent so its
+			// tasks never walk into nodes another task shares, and stitched back in afterwards.  Every
+			// new node is tagged with the item that created it, and nodes is put back in that order so
+			// it lists them as pushing the objects one at a time would have.
+			void build_parts( std::vector<value_type>& objects, thread_pool& pool ) {
+				std::vector<rect_type> bounds;
+				compute_bounds( objects, get_rect, bounds, pool );
+				std::vector<std::pair<std::size_t, node*>> creators;
+				auto keep = [&]( node& n, std::size_t item ) {
+					n.place( std::move( objects[ item ] ), bounds[ item ], *this );
+				};
+				auto make_child = [&]( node& n, int index, std::size_t item ) -> node& {
+					const auto count = nodes.size();
+					auto& child = n.make_child( index, generation, nodes );
+					if( nodes.size() != count ) creators.emplace_back( item, &child );
+					return child;
+				};
+				auto parts = partition_build<max_objects, rect_traits>( root, std::span<rect_type const>( bounds ), build_split_size( objects.size(), pool ), keep, make_child );
+
+				std::vector<node*> parents( parts.size() );
+				std::vector<std::vector<node*>> created( parts.size() );
+				std::vector<std::vector<std::size_t>> created_by( parts.size() );
+				for( std::size_t index = 0; index < parts.size(); ++index ) {
+					parents[ index ] = std::exchange( parts[ index ].pnode->m_pParent, nullptr );
+				}
+				pool.run( parts.size(), [&]( std::size_t index ) {
+					for( auto item : parts[ index ].items ) {
+						parts[ index ].pnode->insert( std::move( objects[ item ] ), bounds[ item ], *this, created[ index ] );
+						created_by[ index ].resize( created[ index ].size(), item );
+					}
+				} );
+
+				// A node made by the partition is an ancestor of any a task made for the same item, and
+				// each list is already in creation order, so a stable sort keeps parents first
+				for( std::size_t index = 0; index < parts.size(); ++index ) {
+					for( std::size_t i = 0; i < created[ index ].size(); ++i ) {
+						creators.emplace_back( created_by[ index ][ i ], created[ index ][ i ] );
+					}
+				}
+				std::stable_sort( creators.begin(), creators.end(), []( auto const& lhs, auto const& rhs ) {
+					return lhs.first < rhs.first;
+				} );
+				nodes.resize( 1 );
+				for( auto const& creator : creators ) {
+					nodes.push_back( creator.second );
+				}
+
+				for( std::size_t index = 0; index < parts.size(); ++index ) {
+					auto* pparent = parents[ index ];
+					if( pparent == nullptr ) continue;
+
+					parts[ index ].pnode->m_pParent = pparent;
+					pparent->refresh_subtree_summaries();
+					pparent->mark_content_stale();
+				}
+				root.refit_content();
+				for( auto* pnode : nodes ) {
+					pnode->m_local_version = generation;
+					pnode->m_subtree_version = generation;
+				}
+				object_count = objects.size();
+			}
+
 			iterator convert( const_iterator citer ) noexcept {
 				auto node_dist = std::distance( nodes.cbegin(), citer.current_node );
 				auto obj_dist = std::distance( ( *citer.current_node )->elements().cbegin(), citer.it );
@@ -631,13 +2541,132 @@ namespace value_qtree
 			template<typename TreeType> friend class const_tree_iterator;
 			template<typename TreeType> friend class node_iterator;
 			template<typename TreeType> friend class const_node_iterator;
+			template<typename TreeA, typename TreeB> friend class tree_join;
 
 			node root;
 			std::function<rect_type( const value_type& )> get_rect;
+			std::function<mask_type( const value_type& )> get_mask;
 			std::vector<node*> nodes;
-			std::size_t count = std::size_t{};
+			std::size_t object_count = std::size_t{};
+			// Bumped by anything that can move nodes or objects, stale cursors are detected with it
+			std::size_t generation = std::size_t{};
+	};
+
+	// Walks two trees together, node pairs whose bounds don't intersect are skipped
+	template<typename TreeA, typename TreeB>
+	class tree_join {
+	public:
+		using rect_traits = typename TreeA::rect_traits;
+		using rect_type = typename TreeA::rect_type;
+		using node_a = typename TreeA::node;
+		using node_b = typename TreeB::node;
+
+		template<typename Callback>
+		static void run( TreeA& lhs, TreeB& rhs, Callback& callback ) {
+			auto forward = [&]( typename TreeA::reference a, typename TreeB::reference b ) { callback( a, b ); };
+			auto reverse = [&]( typename TreeB::reference b, typename TreeA::reference a ) { callback( a, b ); };
+
+			tree_join join;
+			join.join_nodes( lhs.root, rhs.root, forward, reverse );
+		}
+	private:
+		tree_join() = default;
+
+		// Node pairs still to be joined are kept on a stack rather than recursed into
+		template<typename Forward, typename Reverse>
+		void join_nodes( node_a& root_a, node_b& root_b, Forward& forward, Reverse& reverse ) {
+			traversal_stack<std::pair<node_a*, node_b*>> pending;
+			pending.push( { &root_a, &root_b } );
+			while( !pending.empty() ) {
+				auto [pa, pb] = pending.pop();
+				auto& a = *pa;
+				auto& b = *pb;
+
+				// a's elements against all of b's subtree
+				a.for_each_cached( [&]( rect_type const& element_bounds, auto& element ) {
+					if( b.m_pParent == nullptr || rect_traits::intersects( element_bounds, b.bounds() ) )
+						entries_a.emplace_back( element_bounds, &element );
+				} );
+				join_subtree( entries_a, std::size_t{}, b, forward );
+				entries_a.clear();
+
+				// b's elements against a's descendants, a's own elements were just done
+				b.for_each_cached( [&]( rect_type const& element_bounds, auto& element ) {
+					entries_b.emplace_back( element_bounds, &element );
+				} );
+				for( auto& child : a.m_pChildren ) {
+					if( !child ) continue;
+					if( filter( entries_b, std::size_t{}, b.m_data.size(), child->bounds() ) )
+						join_subtree( entries_b, b.m_data.size(), *child, reverse );
+					entries_b.resize( b.m_data.size() );
+				}
+				entries_b.clear();
+
+				for( auto& child_a : a.m_pChildren ) {
+					if( !child_a ) continue;
+					for( auto& child_b : b.m_pChildren ) {
+						if( !child_b ) continue;
+						if( rect_traits::intersects( child_a->bounds(), child_b->bounds() ) )
+							pending.push( { child_a.get(), child_b.get() } );
+					}
+				}
+			}
+		}
+
+		// entries[ first, end ) are tested against every element in the subtree of n
+		template<typename Entry, typename Node, typename Pair>
+		static void join_subtree( std::vector<Entry>& entries, std::size_t first, Node& n, Pair& pair ) {
+			// entries[ first, last ) overlap pnode, anything past last is left over from a finished sibling
+			struct pending_node {
+				Node* pnode = nullptr;
+				std::size_t first = {}, last = {};
+			};
+			traversal_stack<pending_node> pending;
+			pending.push( { &n, first, entries.size() } );
+			while( !pending.empty() ) {
+				const auto current = pending.pop();
+				entries.resize( current.last );
+
+				current.pnode->for_each_cached( [&]( rect_type const& element_bounds, auto& element ) {
+					for( auto i = current.first; i < current.last; ++i ) {
+						if( rect_traits::intersects( entries[ i ].first, element_bounds ) )
+							pair( *entries[ i ].second, element );
+					}
+				} );
+
+				for( auto& child : current.pnode->m_pChildren ) {
+					if( !child ) continue;
+
+					const auto child_first = entries.size();
+					if( filter( entries, current.first, current.last, child->bounds() ) )
+						pending.push( { child.get(), child_first, entries.size() } );
+				}
+			}
+		}
+
+		// Appends the entries in [ first, last ) that overlap bounds, returns true if any were added
+		template<typename Entry>
+		static bool filter( std::vector<Entry>& entries, std::size_t first, std::size_t last, rect_type const& bounds ) {
+			const auto count = entries.size();
+			for( auto i = first; i < last; ++i ) {
+				if( rect_traits::intersects( entries[ i ].first, bounds ) )
+					entries.push_back( entries[ i ] );
+			}
+			return entries.size() > count;
+		}
+	private:
+		std::vector<std::pair<rect_type, typename TreeA::pointer>> entries_a;
+		std::vector<std::pair<rect_type, typename TreeB::pointer>> entries_b;
 	};
 
+	// Calls callback( a, b ) once for every object a in lhs and b in rhs whose cached bounds intersect.
+	// The trees may store different object types but must share rect_traits.
+	template<typename TreeA, typename TreeB, typename Callback>
+		requires std::same_as<typename TreeA::rect_traits, typename TreeB::rect_traits>
+	void spatial_join( TreeA& lhs, TreeB& rhs, Callback&& callback ) {
+		tree_join<TreeA, TreeB>::run( lhs, rhs, callback );
+	}
+
 	template<
 		typename TreeType,
 		typename ValueT,
@@ -912,6 +2941,10 @@ namespace value_qtree
 				if( current_node != ptree->nodes.end() ) {
 					it = ( *current_node )->elements().begin();
 				}
+				else {
+					// Match end(), the last node may not be the last one with elements
+					it = ( *( current_node - 1 ) )->elements().end();
+				}
 			}
 
 			return *this;
@@ -1031,6 +3064,10 @@ namespace value_qtree
 				if( current_node != ptree->nodes.end() ) {
 					it = ( *current_node )->elements().begin();
 				}
+				else {
+					// Match end(), the last node may not be the last one with elements
+					it = ( *( current_node - 1 ) )->elements().end();
+				}
 			}
 
 			return *this;
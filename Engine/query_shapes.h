@@ -0,0 +1,224 @@
+#pragma once
+
+#include "rect_traits.h"
+#include "vector_traits.h"
+#include <algorithm>
+#include <cmath>
+#include <concepts>
+#include <utility>
+#include <vector>
+
+enum class shape_overlap {
+	outside,
+	intersecting,
+	inside
+};
+
+// A shape that can be passed to qtree::query.  classify() is given node bounds
+// and lets the tree skip ( outside ) or take whole ( inside ) a subtree,
+// intersects() is given an element's bounds.
+template<typename Shape, typename RectTraits>
+concept query_shape = requires( Shape const& shape, typename RectTraits::rect_type const& rect ) {
+	{ shape.classify( rect ) } -> std::same_as<shape_overlap>;
+	{ shape.intersects( rect ) } -> std::convertible_to<bool>;
+};
+
+template<typename RectTraits, typename VecTraits>
+class convex_polygon {
+public:
+	using rect_traits = RectTraits;
+	using vec_traits = VecTraits;
+	using rect_type = typename rect_traits::rect_type;
+	using vec_type = typename vec_traits::vector_type;
+	using scalar_type = typename rect_traits::scalar_type;
+
+public:
+	convex_polygon() = default;
+	// Vertices may be wound either way, consecutive duplicates are ignored
+	convex_polygon( std::vector<vec_type> vertices_ )
+		:
+		m_vertices( std::move( vertices_ ) )
+	{
+		auto is_same = []( vec_type const& lhs, vec_type const& rhs ) {
+			return vec_traits::x( lhs ) == vec_traits::x( rhs ) && vec_traits::y( lhs ) == vec_traits::y( rhs );
+		};
+		m_vertices.erase( std::unique( m_vertices.begin(), m_vertices.end(), is_same ), m_vertices.end() );
+		if( m_vertices.size() > std::size_t( 1 ) && is_same( m_vertices.front(), m_vertices.back() ) )
+			m_vertices.pop_back();
+		if( m_vertices.empty() )return;
+
+		// Twice the signed area tells us which way the edge normals point outward
+		auto area = scalar_type( 0 );
+		for( std::size_t i = 0; i < m_vertices.size(); ++i ) {
+			auto const& a = m_vertices[ i ];
+			auto const& b = m_vertices[ ( i + 1 ) % m_vertices.size() ];
+			area += ( vec_traits::x( a ) * vec_traits::y( b ) ) - ( vec_traits::x( b ) * vec_traits::y( a ) );
+		}
+		const auto winding = area < scalar_type( 0 ) ? scalar_type( -1 ) : scalar_type( 1 );
+
+		auto min_x = vec_traits::x( m_vertices.front() ), max_x = min_x;
+		auto min_y = vec_traits::y( m_vertices.front() ), max_y = min_y;
+		m_edges.reserve( m_vertices.size() );
+		for( std::size_t i = 0; i < m_vertices.size(); ++i ) {
+			auto const& a = m_vertices[ i ];
+			auto const& b = m_vertices[ ( i + 1 ) % m_vertices.size() ];
+			const auto nx = ( vec_traits::y( b ) - vec_traits::y( a ) ) * winding;
+			const auto ny = ( vec_traits::x( a ) - vec_traits::x( b ) ) * winding;
+			m_edges.push_back( { nx, ny, ( nx * vec_traits::x( a ) ) + ( ny * vec_traits::y( a ) ) } );
+
+			min_x = std::min( min_x, vec_traits::x( a ) );
+			max_x = std::max( max_x, vec_traits::x( a ) );
+			min_y = std::min( min_y, vec_traits::y( a ) );
+			max_y = std::max( max_y, vec_traits::y( a ) );
+		}
+		m_aabb = rect_traits::construct( min_x, min_y, max_x, max_y );
+	}
+
+	shape_overlap classify( rect_type const& rect )const noexcept {
+		if( m_vertices.empty() || !overlaps_aabb( rect ) ) return shape_overlap::outside;
+
+		bool inside = true;
+		for( auto const& edge : m_edges ) {
+			const auto [low, high] = project( rect, edge );
+			if( low > edge.offset ) return shape_overlap::outside;
+			inside = inside && high <= edge.offset;
+		}
+
+		return inside ? shape_overlap::inside : shape_overlap::intersecting;
+	}
+	bool intersects( rect_type const& rect )const noexcept {
+		return classify( rect ) != shape_overlap::outside;
+	}
+
+	std::vector<vec_type> const& vertices()const noexcept {
+		return m_vertices;
+	}
+	rect_type const& aabb()const noexcept {
+		return m_aabb;
+	}
+private:
+	// Outward normal of an edge and the polygon's extent along it
+	struct edge_type {
+		scalar_type nx, ny, offset;
+	};
+
+	bool overlaps_aabb( rect_type const& rect )const noexcept {
+		return
+			rect_traits::left( rect ) <= rect_traits::right( m_aabb ) &&
+			rect_traits::right( rect ) >= rect_traits::left( m_aabb ) &&
+			rect_traits::top( rect ) <= rect_traits::bottom( m_aabb ) &&
+			rect_traits::bottom( rect ) >= rect_traits::top( m_aabb );
+	}
+	static std::pair<scalar_type, scalar_type> project( rect_type const& rect, edge_type const& edge )noexcept {
+		const auto x0 = edge.nx * rect_traits::left( rect );
+		const auto x1 = edge.nx * rect_traits::right( rect );
+		const auto y0 = edge.ny * rect_traits::top( rect );
+		const auto y1 = edge.ny * rect_traits::bottom( rect );
+		return {
+			std::min( x0, x1 ) + std::min( y0, y1 ),
+			std::max( x0, x1 ) + std::max( y0, y1 )
+		};
+	}
+private:
+	std::vector<vec_type> m_vertices;
+	std::vector<edge_type> m_edges;
+	rect_type m_aabb = {};
+};
+
+template<typename RectTraits, typename VecTraits>
+class rotated_rect {
+public:
+	using rect_traits = RectTraits;
+	using vec_traits = VecTraits;
+	using rect_type = typename rect_traits::rect_type;
+	using vec_type = typename vec_traits::vector_type;
+	using scalar_type = typename rect_traits::scalar_type;
+
+public:
+	// Angle is in radians, rotating the x axis toward the y axis
+	rotated_rect( vec_type const& center, scalar_type half_width, scalar_type half_height, scalar_type angle )
+		:
+		m_polygon( make_corners( center, half_width, half_height, angle ) )
+	{}
+
+	shape_overlap classify( rect_type const& rect )const noexcept {
+		return m_polygon.classify( rect );
+	}
+	bool intersects( rect_type const& rect )const noexcept {
+		return m_polygon.intersects( rect );
+	}
+	convex_polygon<RectTraits, VecTraits> const& polygon()const noexcept {
+		return m_polygon;
+	}
+private:
+	static std::vector<vec_type> make_corners( vec_type const& center, scalar_type half_width, scalar_type half_height, scalar_type angle ) {
+		const auto cx = vec_traits::x( center );
+		const auto cy = vec_traits::y( center );
+		const auto c = std::cos( angle );
+		const auto s = std::sin( angle );
+		auto corner = [&]( scalar_type x_, scalar_type y_ ) {
+			return vec_traits::construct( cx + ( x_ * c ) - ( y_ * s ), cy + ( x_ * s ) + ( y_ * c ) );
+		};
+
+		return {
+			corner( -half_width, -half_height ),
+			corner(  half_width, -half_height ),
+			corner(  half_width,  half_height ),
+			corner( -half_width,  half_height )
+		};
+	}
+private:
+	convex_polygon<RectTraits, VecTraits> m_polygon;
+};
+
+// 2D view frustum: the area between the near and far distances inside a field of view.
+// A near distance of 0 gives a cone shaped sensor.
+template<typename RectTraits, typename VecTraits>
+class view_frustum {
+public:
+	using rect_traits = RectTraits;
+	using vec_traits = VecTraits;
+	using rect_type = typename rect_traits::rect_type;
+	using vec_type = typename vec_traits::vector_type;
+	using scalar_type = typename rect_traits::scalar_type;
+
+public:
+	// field_of_view is the full angle in radians and must be less than pi
+	view_frustum( vec_type const& eye, vec_type const& direction, scalar_type field_of_view, scalar_type near_distance, scalar_type far_distance )
+		:
+		m_polygon( make_corners( eye, direction, field_of_view, near_distance, far_distance ) )
+	{}
+
+	shape_overlap classify( rect_type const& rect )const noexcept {
+		return m_polygon.classify( rect );
+	}
+	bool intersects( rect_type const& rect )const noexcept {
+		return m_polygon.intersects( rect );
+	}
+	convex_polygon<RectTraits, VecTraits> const& polygon()const noexcept {
+		return m_polygon;
+	}
+private:
+	static std::vector<vec_type> make_corners( vec_type const& eye, vec_type const& direction, scalar_type field_of_view, scalar_type near_distance, scalar_type far_distance ) {
+		const auto dir = vec_traits::normalize( direction );
+		const auto dx = vec_traits::x( dir );
+		const auto dy = vec_traits::y( dir );
+		const auto spread = std::tan( field_of_view / scalar_type( 2 ) );
+		auto point = [&]( scalar_type distance, scalar_type side ) {
+			const auto lateral = distance * spread * side;
+			return vec_traits::construct(
+				vec_traits::x( eye ) + ( dx * distance ) - ( dy * lateral ),
+				vec_traits::y( eye ) + ( dy * distance ) + ( dx * lateral )
+			);
+		};
+
+		return {
+			point( near_distance, scalar_type( -1 ) ),
+			point( far_distance, scalar_type( -1 ) ),
+			point( far_distance, scalar_type( 1 ) ),
+			point( near_distance, scalar_type( 1 ) )
+		};
+	}
+private:
+	convex_polygon<RectTraits, VecTraits> m_polygon;
+};
@@ -0,0 +1,551 @@
+#include "rect_kernels.h"
+#include <atomic>
+#include <bit>
+#include <cmath>
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#define RECT_KERNELS_X86 1
+#include <immintrin.h>
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any intrinsic, GCC and Clang need to be told per function
+#if defined( _MSC_VER ) && !defined( __clang__ )
+#define RECT_KERNELS_TARGET( isa_name )
+#else
+#define RECT_KERNELS_TARGET( isa_name ) __attribute__( ( target( isa_name ) ) )
+#endif
+
+namespace rect_kernels
+{
+	namespace
+	{
+		using rects_type = columns<float>;
+
+		struct kernel_table {
+			isa level;
+			std::size_t( *intersect )( float, float, float, float, rects_type, std::uint32_t* )noexcept;
+			std::size_t( *contain )( float, float, rects_type, std::uint32_t* )noexcept;
+			void( *distance )( float, float, rects_type, float* )noexcept;
+			std::size_t( *intersect_packed )( float, float, float, float, float const*, packed_layout, std::size_t, std::uint32_t* )noexcept;
+			std::size_t( *contain_packed )( float, float, float, float, float const*, std::size_t, std::uint32_t* )noexcept;
+			void( *normalize_packed )( float*, std::size_t )noexcept;
+			std::size_t( *overlap_quantized )( std::uint16_t, std::uint16_t, std::uint16_t, std::uint16_t, columns<std::uint16_t>, std::uint32_t* )noexcept;
+		};
+
+		// Everything past the last full vector goes through the portable templates
+		rects_type tail_of( rects_type rects, std::size_t first )noexcept {
+			return { rects.left + first, rects.top + first, rects.right + first, rects.bottom + first, rects.count - first };
+		}
+		std::size_t offset_hits( std::size_t first, std::size_t hit_count, std::size_t tail_hits, std::uint32_t* hits )noexcept {
+			for( std::size_t i = 0; i < tail_hits; ++i )
+				hits[ hit_count + i ] += std::uint32_t( first );
+			return hit_count + tail_hits;
+		}
+		template<typename Mask>
+		std::size_t append_hits( Mask mask, std::size_t first, std::size_t hit_count, std::uint32_t* hits )noexcept {
+			for( ; mask != 0; mask &= mask - 1 )
+				hits[ hit_count++ ] = std::uint32_t( first + std::size_t( std::countr_zero( unsigned( mask ) ) ) );
+			return hit_count;
+		}
+
+		// For packed data, where a vector holds whole items Lanes floats wide
+		template<unsigned Lanes>
+		std::size_t append_whole_items( unsigned mask, std::size_t items, std::size_t first, std::size_t hit_count, std::uint32_t* hits )noexcept {
+			constexpr auto item_mask = ( 1u << Lanes ) - 1u;
+			for( std::size_t j = 0; j < items; ++j ) {
+				hits[ hit_count ] = std::uint32_t( first + j );
+				hit_count += ( ( mask >> ( j * Lanes ) ) & item_mask ) == item_mask ? 1 : 0;
+			}
+			return hit_count;
+		}
+
+		// A packed rect passes when ( rect * signs ) < limits in every lane: the left and top lanes
+		// are compared with the query's far edges, the right and bottom lanes are negated so their >
+		// becomes a < against the query's near edges negated.
+		struct packed_query {
+			float signs[ 4 ];
+			float limits[ 4 ];
+		};
+		packed_query make_packed_query( float left, float top, float right, float bottom, packed_layout layout )noexcept {
+			auto query = packed_query{};
+			query.signs[ layout.left ] = 1.f;
+			query.limits[ layout.left ] = right;
+			query.signs[ layout.top ] = 1.f;
+			query.limits[ layout.top ] = bottom;
+			query.signs[ layout.right ] = -1.f;
+			query.limits[ layout.right ] = -left;
+			query.signs[ layout.bottom ] = -1.f;
+			query.limits[ layout.bottom ] = -top;
+			return query;
+		}
+
+		std::size_t intersect_packed_scalar( float left, float top, float right, float bottom, float const* rects, packed_layout layout, std::size_t count, std::uint32_t* hits )noexcept {
+			auto hit_count = std::size_t{};
+			for( std::size_t i = 0; i < count; ++i ) {
+				auto const* rect = rects + ( i * 4 );
+				hits[ hit_count ] = std::uint32_t( i );
+				hit_count += ( rect[ layout.left ] < right && rect[ layout.right ] > left && rect[ layout.top ] < bottom && rect[ layout.bottom ] > top ) ? 1 : 0;
+			}
+			return hit_count;
+		}
+		std::size_t contain_packed_scalar( float left, float top, float right, float bottom, float const* points, std::size_t count, std::uint32_t* hits )noexcept {
+			auto hit_count = std::size_t{};
+			for( std::size_t i = 0; i < count; ++i ) {
+				const auto x = points[ i * 2 ];
+				const auto y = points[ ( i * 2 ) + 1 ];
+				hits[ hit_count ] = std::uint32_t( i );
+				hit_count += ( x >= left && x < right && y >= top && y < bottom ) ? 1 : 0;
+			}
+			return hit_count;
+		}
+		// Same steps as vector2_traits::normalize so the results match it exactly
+		void normalize_packed_scalar( float* vecs, std::size_t count )noexcept {
+			for( std::size_t i = 0; i < count; ++i ) {
+				auto& x = vecs[ i * 2 ];
+				auto& y = vecs[ ( i * 2 ) + 1 ];
+				if( x == 0.f && y == 0.f ) continue;
+
+				const auto len = 1.f / std::sqrt( ( x * x ) + ( y * y ) );
+				x *= len;
+				y *= len;
+			}
+		}
+
+		std::size_t overlap_quantized_scalar( std::uint16_t left, std::uint16_t top, std::uint16_t right, std::uint16_t bottom, columns<std::uint16_t> rects, std::uint32_t* hits )noexcept {
+			auto hit_count = std::size_t{};
+			for( std::size_t i = 0; i < rects.count; ++i ) {
+				hits[ hit_count ] = std::uint32_t( i );
+				hit_count += ( rects.left[ i ] <= right && rects.right[ i ] >= left && rects.top[ i ] <= bottom && rects.bottom[ i ] >= top ) ? 1 : 0;
+			}
+			return hit_count;
+		}
+
+		std::size_t intersect_scalar( float left, float top, float right, float bottom, rects_type rects, std::uint32_t* hits )noexcept {
+			return intersect_many<float>( left, top, right, bottom, rects, hits );
+		}
+		std::size_t contain_scalar( float x, float y, rects_type rects, std::uint32_t* hits )noexcept {
+			return containing_point<float>( x, y, rects, hits );
+		}
+		void distance_scalar( float x, float y, rects_type rects, float* distances )noexcept {
+			distance_sqr_many<float>( x, y, rects, distances );
+		}
+
+#if defined( RECT_KERNELS_X86 )
+		RECT_KERNELS_TARGET( "sse2" )
+		std::size_t intersect_sse2( float left, float top, float right, float bottom, rects_type rects, std::uint32_t* hits )noexcept {
+			const auto q_left = _mm_set1_ps( left ), q_top = _mm_set1_ps( top );
+			const auto q_right = _mm_set1_ps( right ), q_bottom = _mm_set1_ps( bottom );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 4 <= rects.count; i += 4 ) {
+				const auto x_overlap = _mm_and_ps(
+					_mm_cmplt_ps( _mm_loadu_ps( rects.left + i ), q_right ),
+					_mm_cmpgt_ps( _mm_loadu_ps( rects.right + i ), q_left ) );
+				const auto y_overlap = _mm_and_ps(
+					_mm_cmplt_ps( _mm_loadu_ps( rects.top + i ), q_bottom ),
+					_mm_cmpgt_ps( _mm_loadu_ps( rects.bottom + i ), q_top ) );
+				hit_count = append_hits( _mm_movemask_ps( _mm_and_ps( x_overlap, y_overlap ) ), i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, intersect_many<float>( left, top, right, bottom, tail_of( rects, i ), hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "sse2" )
+		std::size_t contain_sse2( float x, float y, rects_type rects, std::uint32_t* hits )noexcept {
+			const auto px = _mm_set1_ps( x ), py = _mm_set1_ps( y );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 4 <= rects.count; i += 4 ) {
+				const auto inside_x = _mm_and_ps(
+					_mm_cmpge_ps( px, _mm_loadu_ps( rects.left + i ) ),
+					_mm_cmplt_ps( px, _mm_loadu_ps( rects.right + i ) ) );
+				const auto inside_y = _mm_and_ps(
+					_mm_cmpge_ps( py, _mm_loadu_ps( rects.top + i ) ),
+					_mm_cmplt_ps( py, _mm_loadu_ps( rects.bottom + i ) ) );
+				hit_count = append_hits( _mm_movemask_ps( _mm_and_ps( inside_x, inside_y ) ), i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, containing_point<float>( x, y, tail_of( rects, i ), hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "sse2" )
+		void distance_sse2( float x, float y, rects_type rects, float* distances )noexcept {
+			const auto px = _mm_set1_ps( x ), py = _mm_set1_ps( y );
+			const auto zero = _mm_setzero_ps();
+
+			auto i = std::size_t{};
+			for( ; i + 4 <= rects.count; i += 4 ) {
+				const auto dx = _mm_max_ps( _mm_max_ps( _mm_sub_ps( _mm_loadu_ps( rects.left + i ), px ), _mm_sub_ps( px, _mm_loadu_ps( rects.right + i ) ) ), zero );
+				const auto dy = _mm_max_ps( _mm_max_ps( _mm_sub_ps( _mm_loadu_ps( rects.top + i ), py ), _mm_sub_ps( py, _mm_loadu_ps( rects.bottom + i ) ) ), zero );
+				_mm_storeu_ps( distances + i, _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ) );
+			}
+			distance_sqr_many<float>( x, y, tail_of( rects, i ), distances + i );
+		}
+
+		RECT_KERNELS_TARGET( "sse2" )
+		std::size_t intersect_packed_sse2( float left, float top, float right, float bottom, float const* rects, packed_layout layout, std::size_t count, std::uint32_t* hits )noexcept {
+			const auto query = make_packed_query( left, top, right, bottom, layout );
+			const auto signs = _mm_loadu_ps( query.signs );
+			const auto limits = _mm_loadu_ps( query.limits );
+
+			auto hit_count = std::size_t{};
+			for( std::size_t i = 0; i < count; ++i ) {
+				const auto mask = _mm_movemask_ps( _mm_cmplt_ps( _mm_mul_ps( _mm_loadu_ps( rects + ( i * 4 ) ), signs ), limits ) );
+				hits[ hit_count ] = std::uint32_t( i );
+				hit_count += mask == 0xf ? 1 : 0;
+			}
+			return hit_count;
+		}
+		RECT_KERNELS_TARGET( "sse2" )
+		std::size_t contain_packed_sse2( float left, float top, float right, float bottom, float const* points, std::size_t count, std::uint32_t* hits )noexcept {
+			const auto low = _mm_setr_ps( left, top, left, top );
+			const auto high = _mm_setr_ps( right, bottom, right, bottom );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 2 <= count; i += 2 ) {
+				const auto xy = _mm_loadu_ps( points + ( i * 2 ) );
+				const auto inside = _mm_and_ps( _mm_cmpge_ps( xy, low ), _mm_cmplt_ps( xy, high ) );
+				hit_count = append_whole_items<2>( unsigned( _mm_movemask_ps( inside ) ), 2, i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, contain_packed_scalar( left, top, right, bottom, points + ( i * 2 ), count - i, hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "sse2" )
+		void normalize_packed_sse2( float* vecs, std::size_t count )noexcept {
+			const auto zero = _mm_setzero_ps();
+			const auto one = _mm_set1_ps( 1.f );
+
+			auto i = std::size_t{};
+			for( ; i + 2 <= count; i += 2 ) {
+				const auto xy = _mm_loadu_ps( vecs + ( i * 2 ) );
+				// Swapping x and y within each vector puts x * x + y * y in both of its lanes
+				const auto squares = _mm_mul_ps( xy, xy );
+				const auto len = _mm_div_ps( one, _mm_sqrt_ps( _mm_add_ps( squares, _mm_shuffle_ps( squares, squares, _MM_SHUFFLE( 2, 3, 0, 1 ) ) ) ) );
+				const auto is_zero = _mm_cmpeq_ps( xy, zero );
+				const auto keep = _mm_and_ps( is_zero, _mm_shuffle_ps( is_zero, is_zero, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+				_mm_storeu_ps( vecs + ( i * 2 ), _mm_or_ps( _mm_and_ps( keep, xy ), _mm_andnot_ps( keep, _mm_mul_ps( xy, len ) ) ) );
+			}
+			normalize_packed_scalar( vecs + ( i * 2 ), count - i );
+		}
+
+		RECT_KERNELS_TARGET( "sse2" )
+		__m128i load_sse2( std::uint16_t const* column )noexcept {
+			return _mm_loadu_si128( reinterpret_cast<__m128i const*>( column ) );
+		}
+		// Unsigned a <= b is a saturating a - b of zero, so one compare checks all four edges
+		RECT_KERNELS_TARGET( "sse2" )
+		std::size_t overlap_quantized_sse2( std::uint16_t left, std::uint16_t top, std::uint16_t right, std::uint16_t bottom, columns<std::uint16_t> rects, std::uint32_t* hits )noexcept {
+			const auto q_left = _mm_set1_epi16( short( left ) ), q_top = _mm_set1_epi16( short( top ) );
+			const auto q_right = _mm_set1_epi16( short( right ) ), q_bottom = _mm_set1_epi16( short( bottom ) );
+			const auto zero = _mm_setzero_si128();
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 8 <= rects.count; i += 8 ) {
+				const auto misses = _mm_or_si128(
+					_mm_or_si128( _mm_subs_epu16( load_sse2( rects.left + i ), q_right ), _mm_subs_epu16( q_left, load_sse2( rects.right + i ) ) ),
+					_mm_or_si128( _mm_subs_epu16( load_sse2( rects.top + i ), q_bottom ), _mm_subs_epu16( q_top, load_sse2( rects.bottom + i ) ) ) );
+				hit_count = append_whole_items<2>( unsigned( _mm_movemask_epi8( _mm_cmpeq_epi16( misses, zero ) ) ), 8, i, hit_count, hits );
+			}
+			columns<std::uint16_t> tail = { rects.left + i, rects.top + i, rects.right + i, rects.bottom + i, rects.count - i };
+			return offset_hits( i, hit_count, overlap_quantized_scalar( left, top, right, bottom, tail, hits + hit_count ), hits );
+		}
+
+		RECT_KERNELS_TARGET( "avx2" )
+		std::size_t intersect_avx2( float left, float top, float right, float bottom, rects_type rects, std::uint32_t* hits )noexcept {
+			const auto q_left = _mm256_set1_ps( left ), q_top = _mm256_set1_ps( top );
+			const auto q_right = _mm256_set1_ps( right ), q_bottom = _mm256_set1_ps( bottom );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 8 <= rects.count; i += 8 ) {
+				const auto x_overlap = _mm256_and_ps(
+					_mm256_cmp_ps( _mm256_loadu_ps( rects.left + i ), q_right, _CMP_LT_OQ ),
+					_mm256_cmp_ps( _mm256_loadu_ps( rects.right + i ), q_left, _CMP_GT_OQ ) );
+				const auto y_overlap = _mm256_and_ps(
+					_mm256_cmp_ps( _mm256_loadu_ps( rects.top + i ), q_bottom, _CMP_LT_OQ ),
+					_mm256_cmp_ps( _mm256_loadu_ps( rects.bottom + i ), q_top, _CMP_GT_OQ ) );
+				hit_count = append_hits( _mm256_movemask_ps( _mm256_and_ps( x_overlap, y_overlap ) ), i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, intersect_many<float>( left, top, right, bottom, tail_of( rects, i ), hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx2" )
+		std::size_t contain_avx2( float x, float y, rects_type rects, std::uint32_t* hits )noexcept {
+			const auto px = _mm256_set1_ps( x ), py = _mm256_set1_ps( y );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 8 <= rects.count; i += 8 ) {
+				const auto inside_x = _mm256_and_ps(
+					_mm256_cmp_ps( px, _mm256_loadu_ps( rects.left + i ), _CMP_GE_OQ ),
+					_mm256_cmp_ps( px, _mm256_loadu_ps( rects.right + i ), _CMP_LT_OQ ) );
+				const auto inside_y = _mm256_and_ps(
+					_mm256_cmp_ps( py, _mm256_loadu_ps( rects.top + i ), _CMP_GE_OQ ),
+					_mm256_cmp_ps( py, _mm256_loadu_ps( rects.bottom + i ), _CMP_LT_OQ ) );
+				hit_count = append_hits( _mm256_movemask_ps( _mm256_and_ps( inside_x, inside_y ) ), i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, containing_point<float>( x, y, tail_of( rects, i ), hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx2" )
+		void distance_avx2( float x, float y, rects_type rects, float* distances )noexcept {
+			const auto px = _mm256_set1_ps( x ), py = _mm256_set1_ps( y );
+			const auto zero = _mm256_setzero_ps();
+
+			auto i = std::size_t{};
+			for( ; i + 8 <= rects.count; i += 8 ) {
+				const auto dx = _mm256_max_ps( _mm256_max_ps( _mm256_sub_ps( _mm256_loadu_ps( rects.left + i ), px ), _mm256_sub_ps( px, _mm256_loadu_ps( rects.right + i ) ) ), zero );
+				const auto dy = _mm256_max_ps( _mm256_max_ps( _mm256_sub_ps( _mm256_loadu_ps( rects.top + i ), py ), _mm256_sub_ps( py, _mm256_loadu_ps( rects.bottom + i ) ) ), zero );
+				_mm256_storeu_ps( distances + i, _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ) );
+			}
+			distance_sqr_many<float>( x, y, tail_of( rects, i ), distances + i );
+		}
+
+		RECT_KERNELS_TARGET( "avx2" )
+		std::size_t intersect_packed_avx2( float left, float top, float right, float bottom, float const* rects, packed_layout layout, std::size_t count, std::uint32_t* hits )noexcept {
+			const auto query = make_packed_query( left, top, right, bottom, layout );
+			const auto signs = _mm256_broadcast_ps( reinterpret_cast<__m128 const*>( query.signs ) );
+			const auto limits = _mm256_broadcast_ps( reinterpret_cast<__m128 const*>( query.limits ) );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 2 <= count; i += 2 ) {
+				const auto passed = _mm256_cmp_ps( _mm256_mul_ps( _mm256_loadu_ps( rects + ( i * 4 ) ), signs ), limits, _CMP_LT_OQ );
+				hit_count = append_whole_items<4>( unsigned( _mm256_movemask_ps( passed ) ), 2, i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, intersect_packed_scalar( left, top, right, bottom, rects + ( i * 4 ), layout, count - i, hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx2" )
+		std::size_t contain_packed_avx2( float left, float top, float right, float bottom, float const* points, std::size_t count, std::uint32_t* hits )noexcept {
+			const auto low = _mm256_setr_ps( left, top, left, top, left, top, left, top );
+			const auto high = _mm256_setr_ps( right, bottom, right, bottom, right, bottom, right, bottom );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 4 <= count; i += 4 ) {
+				const auto xy = _mm256_loadu_ps( points + ( i * 2 ) );
+				const auto inside = _mm256_and_ps( _mm256_cmp_ps( xy, low, _CMP_GE_OQ ), _mm256_cmp_ps( xy, high, _CMP_LT_OQ ) );
+				hit_count = append_whole_items<2>( unsigned( _mm256_movemask_ps( inside ) ), 4, i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, contain_packed_scalar( left, top, right, bottom, points + ( i * 2 ), count - i, hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx2" )
+		void normalize_packed_avx2( float* vecs, std::size_t count )noexcept {
+			const auto zero = _mm256_setzero_ps();
+			const auto one = _mm256_set1_ps( 1.f );
+
+			auto i = std::size_t{};
+			for( ; i + 4 <= count; i += 4 ) {
+				const auto xy = _mm256_loadu_ps( vecs + ( i * 2 ) );
+				const auto squares = _mm256_mul_ps( xy, xy );
+				const auto len = _mm256_div_ps( one, _mm256_sqrt_ps( _mm256_add_ps( squares, _mm256_shuffle_ps( squares, squares, _MM_SHUFFLE( 2, 3, 0, 1 ) ) ) ) );
+				const auto is_zero = _mm256_cmp_ps( xy, zero, _CMP_EQ_OQ );
+				const auto keep = _mm256_and_ps( is_zero, _mm256_shuffle_ps( is_zero, is_zero, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+				_mm256_storeu_ps( vecs + ( i * 2 ), _mm256_blendv_ps( _mm256_mul_ps( xy, len ), xy, keep ) );
+			}
+			normalize_packed_scalar( vecs + ( i * 2 ), count - i );
+		}
+
+		RECT_KERNELS_TARGET( "avx2" )
+		__m256i load_avx2( std::uint16_t const* column )noexcept {
+			return _mm256_loadu_si256( reinterpret_cast<__m256i const*>( column ) );
+		}
+		RECT_KERNELS_TARGET( "avx2" )
+		std::size_t overlap_quantized_avx2( std::uint16_t left, std::uint16_t top, std::uint16_t right, std::uint16_t bottom, columns<std::uint16_t> rects, std::uint32_t* hits )noexcept {
+			const auto q_left = _mm256_set1_epi16( short( left ) ), q_top = _mm256_set1_epi16( short( top ) );
+			const auto q_right = _mm256_set1_epi16( short( right ) ), q_bottom = _mm256_set1_epi16( short( bottom ) );
+			const auto zero = _mm256_setzero_si256();
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 16 <= rects.count; i += 16 ) {
+				const auto misses = _mm256_or_si256(
+					_mm256_or_si256( _mm256_subs_epu16( load_avx2( rects.left + i ), q_right ), _mm256_subs_epu16( q_left, load_avx2( rects.right + i ) ) ),
+					_mm256_or_si256( _mm256_subs_epu16( load_avx2( rects.top + i ), q_bottom ), _mm256_subs_epu16( q_top, load_avx2( rects.bottom + i ) ) ) );
+				hit_count = append_whole_items<2>( unsigned( _mm256_movemask_epi8( _mm256_cmpeq_epi16( misses, zero ) ) ), 16, i, hit_count, hits );
+			}
+			columns<std::uint16_t> tail = { rects.left + i, rects.top + i, rects.right + i, rects.bottom + i, rects.count - i };
+			return offset_hits( i, hit_count, overlap_quantized_scalar( left, top, right, bottom, tail, hits + hit_count ), hits );
+		}
+
+		RECT_KERNELS_TARGET( "avx512f" )
+		std::size_t intersect_avx512( float left, float top, float right, float bottom, rects_type rects, std::uint32_t* hits )noexcept {
+			const auto q_left = _mm512_set1_ps( left ), q_top = _mm512_set1_ps( top );
+			const auto q_right = _mm512_set1_ps( right ), q_bottom = _mm512_set1_ps( bottom );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 16 <= rects.count; i += 16 ) {
+				const auto mask =
+					_mm512_cmp_ps_mask( _mm512_loadu_ps( rects.left + i ), q_right, _CMP_LT_OQ ) &
+					_mm512_cmp_ps_mask( _mm512_loadu_ps( rects.right + i ), q_left, _CMP_GT_OQ ) &
+					_mm512_cmp_ps_mask( _mm512_loadu_ps( rects.top + i ), q_bottom, _CMP_LT_OQ ) &
+					_mm512_cmp_ps_mask( _mm512_loadu_ps( rects.bottom + i ), q_top, _CMP_GT_OQ );
+				hit_count = append_hits( unsigned( mask ), i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, intersect_many<float>( left, top, right, bottom, tail_of( rects, i ), hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx512f" )
+		std::size_t contain_avx512( float x, float y, rects_type rects, std::uint32_t* hits )noexcept {
+			const auto px = _mm512_set1_ps( x ), py = _mm512_set1_ps( y );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 16 <= rects.count; i += 16 ) {
+				const auto mask =
+					_mm512_cmp_ps_mask( px, _mm512_loadu_ps( rects.left + i ), _CMP_GE_OQ ) &
+					_mm512_cmp_ps_mask( px, _mm512_loadu_ps( rects.right + i ), _CMP_LT_OQ ) &
+					_mm512_cmp_ps_mask( py, _mm512_loadu_ps( rects.top + i ), _CMP_GE_OQ ) &
+					_mm512_cmp_ps_mask( py, _mm512_loadu_ps( rects.bottom + i ), _CMP_LT_OQ );
+				hit_count = append_hits( unsigned( mask ), i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, containing_point<float>( x, y, tail_of( rects, i ), hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx512f" )
+		void distance_avx512( float x, float y, rects_type rects, float* distances )noexcept {
+			const auto px = _mm512_set1_ps( x ), py = _mm512_set1_ps( y );
+			const auto zero = _mm512_setzero_ps();
+
+			auto i = std::size_t{};
+			for( ; i + 16 <= rects.count; i += 16 ) {
+				const auto dx = _mm512_max_ps( _mm512_max_ps( _mm512_sub_ps( _mm512_loadu_ps( rects.left + i ), px ), _mm512_sub_ps( px, _mm512_loadu_ps( rects.right + i ) ) ), zero );
+				const auto dy = _mm512_max_ps( _mm512_max_ps( _mm512_sub_ps( _mm512_loadu_ps( rects.top + i ), py ), _mm512_sub_ps( py, _mm512_loadu_ps( rects.bottom + i ) ) ), zero );
+				_mm512_storeu_ps( distances + i, _mm512_add_ps( _mm512_mul_ps( dx, dx ), _mm512_mul_ps( dy, dy ) ) );
+			}
+			distance_sqr_many<float>( x, y, tail_of( rects, i ), distances + i );
+		}
+		RECT_KERNELS_TARGET( "avx512f" )
+		std::size_t intersect_packed_avx512( float left, float top, float right, float bottom, float const* rects, packed_layout layout, std::size_t count, std::uint32_t* hits )noexcept {
+			const auto query = make_packed_query( left, top, right, bottom, layout );
+			const auto signs = _mm512_broadcast_f32x4( _mm_loadu_ps( query.signs ) );
+			const auto limits = _mm512_broadcast_f32x4( _mm_loadu_ps( query.limits ) );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 4 <= count; i += 4 ) {
+				const auto passed = _mm512_cmp_ps_mask( _mm512_mul_ps( _mm512_loadu_ps( rects + ( i * 4 ) ), signs ), limits, _CMP_LT_OQ );
+				hit_count = append_whole_items<4>( unsigned( passed ), 4, i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, intersect_packed_scalar( left, top, right, bottom, rects + ( i * 4 ), layout, count - i, hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx512f" )
+		std::size_t contain_packed_avx512( float left, float top, float right, float bottom, float const* points, std::size_t count, std::uint32_t* hits )noexcept {
+			const auto low = _mm512_broadcast_f32x4( _mm_setr_ps( left, top, left, top ) );
+			const auto high = _mm512_broadcast_f32x4( _mm_setr_ps( right, bottom, right, bottom ) );
+
+			auto hit_count = std::size_t{};
+			auto i = std::size_t{};
+			for( ; i + 8 <= count; i += 8 ) {
+				const auto xy = _mm512_loadu_ps( points + ( i * 2 ) );
+				const auto inside = _mm512_cmp_ps_mask( xy, low, _CMP_GE_OQ ) & _mm512_cmp_ps_mask( xy, high, _CMP_LT_OQ );
+				hit_count = append_whole_items<2>( unsigned( inside ), 8, i, hit_count, hits );
+			}
+			return offset_hits( i, hit_count, contain_packed_scalar( left, top, right, bottom, points + ( i * 2 ), count - i, hits + hit_count ), hits );
+		}
+		RECT_KERNELS_TARGET( "avx512f" )
+		void normalize_packed_avx512( float* vecs, std::size_t count )noexcept {
+			const auto zero = _mm512_setzero_ps();
+			const auto one = _mm512_set1_ps( 1.f );
+
+			auto i = std::size_t{};
+			for( ; i + 8 <= count; i += 8 ) {
+				const auto xy = _mm512_loadu_ps( vecs + ( i * 2 ) );
+				const auto squares = _mm512_mul_ps( xy, xy );
+				const auto len = _mm512_div_ps( one, _mm512_sqrt_ps( _mm512_add_ps( squares, _mm512_shuffle_ps( squares, squares, _MM_SHUFFLE( 2, 3, 0, 1 ) ) ) ) );
+				const auto is_zero = unsigned( _mm512_cmp_ps_mask( xy, zero, _CMP_EQ_OQ ) );
+				const auto keep = is_zero & ( ( ( is_zero >> 1 ) & 0x5555u ) | ( ( is_zero << 1 ) & 0xaaaau ) );
+				_mm512_storeu_ps( vecs + ( i * 2 ), _mm512_mask_blend_ps( __mmask16( keep ), _mm512_mul_ps( xy, len ), xy ) );
+			}
+			normalize_packed_scalar( vecs + ( i * 2 ), count - i );
+		}
+#endif
+
+		constexpr kernel_table tables[] = {
+			{ isa::scalar, intersect_scalar, contain_scalar, distance_scalar, intersect_packed_scalar, contain_packed_scalar, normalize_packed_scalar, overlap_quantized_scalar },
+#if defined( RECT_KERNELS_X86 )
+			{ isa::sse2, intersect_sse2, contain_sse2, distance_sse2, intersect_packed_sse2, contain_packed_sse2, normalize_packed_sse2, overlap_quantized_sse2 },
+			{ isa::avx2, intersect_avx2, contain_avx2, distance_avx2, intersect_packed_avx2, contain_packed_avx2, normalize_packed_avx2, overlap_quantized_avx2 },
+			// 16-bit lanes need AVX-512BW, which this level doesn't check for, so the AVX2 version stands in
+			{ isa::avx512, intersect_avx512, contain_avx512, distance_avx512, intersect_packed_avx512, contain_packed_avx512, normalize_packed_avx512, overlap_quantized_avx2 },
+#endif
+		};
+
+		isa query_cpu()noexcept {
+#if defined( RECT_KERNELS_X86 ) && defined( _MSC_VER ) && !defined( __clang__ )
+			int info[ 4 ] = {};
+			__cpuid( info, 0 );
+			const auto max_leaf = info[ 0 ];
+
+			__cpuid( info, 1 );
+			const auto sse2 = ( info[ 3 ] & ( 1 << 26 ) ) != 0;
+			// The OS has to save the wider registers too, which xgetbv reports
+			const auto xcr0 = ( info[ 2 ] & ( 1 << 27 ) ) != 0 ? _xgetbv( 0 ) : 0ull;
+			const auto ymm_saved = ( xcr0 & 0x06 ) == 0x06;
+			const auto zmm_saved = ( xcr0 & 0xe6 ) == 0xe6;
+
+			auto avx2 = false, avx512 = false;
+			if( max_leaf >= 7 ) {
+				__cpuidex( info, 7, 0 );
+				avx2 = ( info[ 1 ] & ( 1 << 5 ) ) != 0;
+				avx512 = ( info[ 1 ] & ( 1 << 16 ) ) != 0;
+			}
+
+			if( avx512 && zmm_saved ) return isa::avx512;
+			if( avx2 && ymm_saved ) return isa::avx2;
+			if( sse2 ) return isa::sse2;
+#elif defined( RECT_KERNELS_X86 )
+			// These check OS support for the wider registers as well
+			__builtin_cpu_init();
+			if( __builtin_cpu_supports( "avx512f" ) ) return isa::avx512;
+			if( __builtin_cpu_supports( "avx2" ) ) return isa::avx2;
+			if( __builtin_cpu_supports( "sse2" ) ) return isa::sse2;
+#endif
+			return isa::scalar;
+		}
+
+		// Picked the first time any kernel runs, then only changed by force
+		std::atomic<kernel_table const*>& current_table()noexcept {
+			static std::atomic<kernel_table const*> table{ &tables[ std::size_t( detect() ) ] };
+			return table;
+		}
+		kernel_table const& kernels()noexcept {
+			return *current_table().load( std::memory_order_relaxed );
+		}
+	}
+
+	isa detect()noexcept {
+		static const auto level = query_cpu();
+		return level;
+	}
+	isa active()noexcept {
+		return kernels().level;
+	}
+	bool force( isa level )noexcept {
+		if( level > detect() ) return false;
+
+		current_table().store( &tables[ std::size_t( level ) ], std::memory_order_relaxed );
+		return true;
+	}
+
+	std::size_t intersect_many( float left, float top, float right, float bottom, columns<float> rects, std::uint32_t* hits )noexcept {
+		return kernels().intersect( left, top, right, bottom, rects, hits );
+	}
+	std::size_t containing_point( float x, float y, columns<float> rects, std::uint32_t* hits )noexcept {
+		return kernels().contain( x, y, rects, hits );
+	}
+	void distance_sqr_many( float x, float y, columns<float> rects, float* distances )noexcept {
+		kernels().distance( x, y, rects, distances );
+	}
+	std::size_t intersect_packed( float left, float top, float right, float bottom, float const* rects, packed_layout layout, std::size_t count, std::uint32_t* hits )noexcept {
+		return kernels().intersect_packed( left, top, right, bottom, rects, layout, count, hits );
+	}
+	std::size_t contain_packed( float left, float top, float right, float bottom, float const* points, std::size_t count, std::uint32_t* hits )noexcept {
+		return kernels().contain_packed( left, top, right, bottom, points, count, hits );
+	}
+	void normalize_packed( float* vecs, std::size_t count )noexcept {
+		kernels().normalize_packed( vecs, count );
+	}
+	std::size_t overlap_quantized( std::uint16_t left, std::uint16_t top, std::uint16_t right, std::uint16_t bottom, columns<std::uint16_t> rects, std::uint32_t* hits )noexcept {
+		return kernels().overlap_quantized( left, top, right, bottom, rects, hits );
+	}
+}
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace rect_kernels
+{
+	// Instruction sets the float kernels are built for, in increasing order
+	enum class isa {
+		scalar,
+		sse2,
+		avx2,
+		avx512
+	};
+
+	// Best variant this CPU and OS can run, read from CPUID
+	isa detect()noexcept;
+	// Variant the float kernels currently use, detect() unless forced
+	isa active()noexcept;
+	// Switches every float kernel to level, for benchmarking one variant against another.
+	// Returns false and changes nothing if this CPU can't run it.  Not meant to race with running kernels.
+	bool force( isa level )noexcept;
+
+	// Rect bounds stored as structure of arrays, count entries in each
+	template<typename Scalar>
+	struct columns {
+		Scalar const* left = nullptr;
+		Scalar const* top = nullptr;
+		Scalar const* right = nullptr;
+		Scalar const* bottom = nullptr;
+		std::size_t count = std::size_t{};
+	};
+
+	// Where left, top, right and bottom sit among the four floats of a packed rect type
+	struct packed_layout {
+		std::size_t left = 0;
+		std::size_t top = 1;
+		std::size_t right = 2;
+		std::size_t bottom = 3;
+	};
+
+	// Float versions, the variant is picked from CPUID the first time one is called.
+	// See the templates below for what each computes.
+	std::size_t intersect_many( float left, float top, float right, float bottom, columns<float> rects, std::uint32_t* hits )noexcept;
+	std::size_t containing_point( float x, float y, columns<float> rects, std::uint32_t* hits )noexcept;
+	void distance_sqr_many( float x, float y, columns<float> rects, float* distances )noexcept;
+
+	// Versions for arrays of rects or points stored as plain floats, which rect_traits and
+	// vector2_traits use for their batch functions.  Results are the same as the single item
+	// functions there: rects holds count rects laid out as layout says, points and vecs hold
+	// count x, y pairs, and vecs are normalized in place.
+	std::size_t intersect_packed( float left, float top, float right, float bottom, float const* rects, packed_layout layout, std::size_t count, std::uint32_t* hits )noexcept;
+	std::size_t contain_packed( float left, float top, float right, float bottom, float const* points, std::size_t count, std::uint32_t* hits )noexcept;
+	void normalize_packed( float* vecs, std::size_t count )noexcept;
+
+	// Indices of the 16-bit rects overlapping the query, touching included, which is what
+	// quantized_columns needs to stay conservative after rounding
+	std::size_t overlap_quantized( std::uint16_t left, std::uint16_t top, std::uint16_t right, std::uint16_t bottom, columns<std::uint16_t> rects, std::uint32_t* hits )noexcept;
+
+	// Writes the index of every rect intersecting the query rect to hits and returns how many there
+	// were.  Same strict test as rect_traits::intersects, hits needs room for rects.count entries.
+	template<typename Scalar>
+	std::size_t intersect_many( Scalar left, Scalar top, Scalar right, Scalar bottom, columns<Scalar> rects, std::uint32_t* hits )noexcept {
+		auto hit_count = std::size_t{};
+
+		// Written unconditionally and kept only on a hit, so there is no branch to mispredict
+		for( std::size_t i = 0; i < rects.count; ++i ) {
+			hits[ hit_count ] = std::uint32_t( i );
+			hit_count += ( rects.left[ i ] < right && rects.right[ i ] > left && rects.top[ i ] < bottom && rects.bottom[ i ] > top ) ? 1 : 0;
+		}
+
+		return hit_count;
+	}
+
+	// Indices of the rects containing the point, half open like rect_traits::contains for points
+	template<typename Scalar>
+	std::size_t containing_point( Scalar x, Scalar y, columns<Scalar> rects, std::uint32_t* hits )noexcept {
+		auto hit_count = std::size_t{};
+		for( std::size_t i = 0; i < rects.count; ++i ) {
+			hits[ hit_count ] = std::uint32_t( i );
+			hit_count += ( x >= rects.left[ i ] && x < rects.right[ i ] && y >= rects.top[ i ] && y < rects.bottom[ i ] ) ? 1 : 0;
+		}
+
+		return hit_count;
+	}
+
+	// Squared distance from the point to each rect as rect_traits::distance_sqr, zero inside
+	template<typename Scalar>
+	void distance_sqr_many( Scalar x, Scalar y, columns<Scalar> rects, Scalar* distances )noexcept {
+		constexpr auto zero = Scalar( 0 );
+		for( std::size_t i = 0; i < rects.count; ++i ) {
+			const auto dx = x < rects.left[ i ] ? rects.left[ i ] - x : x > rects.right[ i ] ? x - rects.right[ i ] : zero;
+			const auto dy = y < rects.top[ i ] ? rects.top[ i ] - y : y > rects.bottom[ i ] ? y - rects.bottom[ i ] : zero;
+			distances[ i ] = ( dx * dx ) + ( dy * dy );
+		}
+	}
+}
+
+// Bounds of a node's elements stored as structure of arrays, index for index with the elements,
+// so a whole node can be tested with one rect_kernels call
+template<typename RectTraits>
+class rect_columns {
+public:
+	using rect_traits = RectTraits;
+	using rect_type = typename rect_traits::rect_type;
+	using scalar_type = std::remove_cvref_t<typename rect_traits::scalar_type>;
+
+public:
+	std::size_t size()const noexcept {
+		return m_left.size();
+	}
+	void reserve( std::size_t count ) {
+		m_left.reserve( count );
+		m_top.reserve( count );
+		m_right.reserve( count );
+		m_bottom.reserve( count );
+	}
+	void push_back( rect_type const& rect ) {
+		m_left.push_back( rect_traits::left( rect ) );
+		m_top.push_back( rect_traits::top( rect ) );
+		m_right.push_back( rect_traits::right( rect ) );
+		m_bottom.push_back( rect_traits::bottom( rect ) );
+	}
+	void insert( std::size_t index, rect_type const& rect ) {
+		m_left.insert( m_left.begin() + index, rect_traits::left( rect ) );
+		m_top.insert( m_top.begin() + index, rect_traits::top( rect ) );
+		m_right.insert( m_right.begin() + index, rect_traits::right( rect ) );
+		m_bottom.insert( m_bottom.begin() + index, rect_traits::bottom( rect ) );
+	}
+	void assign( std::size_t index, rect_type const& rect )noexcept {
+		m_left[ index ] = rect_traits::left( rect );
+		m_top[ index ] = rect_traits::top( rect );
+		m_right[ index ] = rect_traits::right( rect );
+		m_bottom[ index ] = rect_traits::bottom( rect );
+	}
+	void erase( std::size_t index ) {
+		m_left.erase( m_left.begin() + index );
+		m_top.erase( m_top.begin() + index );
+		m_right.erase( m_right.begin() + index );
+		m_bottom.erase( m_bottom.begin() + index );
+	}
+	void clear()noexcept {
+		m_left.clear();
+		m_top.clear();
+		m_right.clear();
+		m_bottom.clear();
+	}
+
+	rect_type operator[]( std::size_t index )const noexcept {
+		return rect_traits::construct( m_left[ index ], m_top[ index ], m_right[ index ], m_bottom[ index ] );
+	}
+	rect_kernels::columns<scalar_type> view()const noexcept {
+		return view( 0, size() );
+	}
+	rect_kernels::columns<scalar_type> view( std::size_t first, std::size_t count )const noexcept {
+		return { m_left.data() + first, m_top.data() + first, m_right.data() + first, m_bottom.data() + first, count };
+	}
+
+	// Indices of the rects intersecting query go to hits, which needs room for size() entries
+	std::size_t intersecting( rect_type const& query, std::uint32_t* hits )const noexcept {
+		return intersecting( query, 0, size(), hits );
+	}
+	// Same for the rects in [first, first + count), hits needs room for count entries
+	std::size_t intersecting( rect_type const& query, std::size_t first, std::size_t count, std::uint32_t* hits )const noexcept {
+		const auto hit_count = rect_kernels::intersect_many(
+			scalar_type( rect_traits::left( query ) ), scalar_type( rect_traits::top( query ) ),
+			scalar_type( rect_traits::right( query ) ), scalar_type( rect_traits::bottom( query ) ),
+			view( first, count ), hits );
+		return offset( hits, hit_count, first );
+	}
+	// Indices of the rects in [first, first + count) containing the point go to hits, which needs room for count entries
+	std::size_t containing( scalar_type x, scalar_type y, std::size_t first, std::size_t count, std::uint32_t* hits )const noexcept {
+		return offset( hits, rect_kernels::containing_point( x, y, view( first, count ), hits ), first );
+	}
+	// Squared distance from the point to each rect, distances needs room for size() entries
+	void distances_sqr( scalar_type x, scalar_type y, scalar_type* distances )const noexcept {
+		rect_kernels::distance_sqr_many( x, y, view(), distances );
+	}
+private:
+	// Kernels number hits from the start of the range they were given
+	static std::size_t offset( std::uint32_t* hits, std::size_t hit_count, std::size_t first )noexcept {
+		for( std::size_t i = 0; i < hit_count; ++i )
+			hits[ i ] += std::uint32_t( first );
+		return hit_count;
+	}
+private:
+	std::vector<scalar_type> m_left, m_top, m_right, m_bottom;
+};
+
+// Drop-in for rect_columns that scans 16-bit bounds measured against a frame, normally the
+// node's bounds, rounded outward so no hit is missed.  The full bounds are kept aside and only
+// read for the exact test on quantized hits, so scans touch half the memory and AVX2 tests 16
+// elements per instruction.
+template<typename RectTraits>
+class quantized_columns {
+public:
+	using rect_traits = RectTraits;
+	using rect_type = typename rect_traits::rect_type;
+	using scalar_type = std::remove_cvref_t<typename rect_traits::scalar_type>;
+
+public:
+	explicit quantized_columns( rect_type const& frame )noexcept
+		:
+		m_origin_x( real( rect_traits::left( frame ) ) ),
+		m_origin_y( real( rect_traits::top( frame ) ) ),
+		m_scale_x( scale_for( rect_traits::left( frame ), rect_traits::right( frame ) ) ),
+		m_scale_y( scale_for( rect_traits::top( frame ), rect_traits::bottom( frame ) ) )
+	{}
+
+	std::size_t size()const noexcept {
+		return m_rects.size();
+	}
+	void reserve( std::size_t count ) {
+		m_left.reserve( count );
+		m_top.reserve( count );
+		m_right.reserve( count );
+		m_bottom.reserve( count );
+		m_rects.reserve( count );
+	}
+	void push_back( rect_type const& rect ) {
+		m_left.push_back( low_x( rect_traits::left( rect ) ) );
+		m_top.push_back( low_y( rect_traits::top( rect ) ) );
+		m_right.push_back( high_x( rect_traits::right( rect ) ) );
+		m_bottom.push_back( high_y( rect_traits::bottom( rect ) ) );
+		m_rects.push_back( rect );
+	}
+	void insert( std::size_t index, rect_type const& rect ) {
+		m_left.insert( m_left.begin() + index, low_x( rect_traits::left( rect ) ) );
+		m_top.insert( m_top.begin() + index, low_y( rect_traits::top( rect ) ) );
+		m_right.insert( m_right.begin() + index, high_x( rect_traits::right( rect ) ) );
+		m_bottom.insert( m_bottom.begin() + index, high_y( rect_traits::bottom( rect ) ) );
+		m_rects.insert( m_rects.begin() + index, rect );
+	}
+	void assign( std::size_t index, rect_type const& rect )noexcept {
+		m_left[ index ] = low_x( rect_traits::left( rect ) );
+		m_top[ index ] = low_y( rect_traits::top( rect ) );
+		m_right[ index ] = high_x( rect_traits::right( rect ) );
+		m_bottom[ index ] = high_y( rect_traits::bottom( rect ) );
+		m_rects[ index ] = rect;
+	}
+	void erase( std::size_t index ) {
+		m_left.erase( m_left.begin() + index );
+		m_top.erase( m_top.begin() + index );
+		m_right.erase( m_right.begin() + index );
+		m_bottom.erase( m_bottom.begin() + index );
+		m_rects.erase( m_rects.begin() + index );
+	}
+	void clear()noexcept {
+		m_left.clear();
+		m_top.clear();
+		m_right.clear();
+		m_bottom.clear();
+		m_rects.clear();
+	}
+
+	rect_type operator[]( std::size_t index )const noexcept {
+		return m_rects[ index ];
+	}
+
+	// Indices of the rects intersecting query go to hits, which needs room for size() entries
+	std::size_t intersecting( rect_type const& query, std::uint32_t* hits )const noexcept {
+		return intersecting( query, 0, size(), hits );
+	}
+	// Same for the rects in [first, first + count), hits needs room for count entries
+	std::size_t intersecting( rect_type const& query, std::size_t first, std::size_t count, std::uint32_t* hits )const noexcept {
+		const auto candidates = rect_kernels::overlap_quantized(
+			low_x( rect_traits::left( query ) ), low_y( rect_traits::top( query ) ),
+			high_x( rect_traits::right( query ) ), high_y( rect_traits::bottom( query ) ),
+			view( first, count ), hits );
+		for( std::size_t i = 0; i < candidates; ++i )
+			hits[ i ] += std::uint32_t( first );
+
+		return keep_if( hits, candidates, [&]( rect_type const& rect ) { return rect_traits::intersects( rect, query ); } );
+	}
+	// Indices of the rects in [first, first + count) containing the point go to hits, which needs room for count entries
+	std::size_t containing( scalar_type x, scalar_type y, std::size_t first, std::size_t count, std::uint32_t* hits )const noexcept {
+		const auto candidates = rect_kernels::overlap_quantized( low_x( x ), low_y( y ), high_x( x ), high_y( y ), view( first, count ), hits );
+		for( std::size_t i = 0; i < candidates; ++i )
+			hits[ i ] += std::uint32_t( first );
+
+		return keep_if( hits, candidates, [&]( rect_type const& rect ) {
+			return
+				x >= rect_traits::left( rect ) && x < rect_traits::right( rect ) &&
+				y >= rect_traits::top( rect ) && y < rect_traits::bottom( rect );
+		} );
+	}
+	// Squared distance from the point to each rect, distances needs room for size() entries
+	void distances_sqr( scalar_type x, scalar_type y, scalar_type* distances )const noexcept {
+		constexpr auto zero = scalar_type( 0 );
+		for( std::size_t i = 0; i < m_rects.size(); ++i ) {
+			auto const& rect = m_rects[ i ];
+			const auto dx = x < rect_traits::left( rect ) ? rect_traits::left( rect ) - x : x > rect_traits::right( rect ) ? x - rect_traits::right( rect ) : zero;
+			const auto dy = y < rect_traits::top( rect ) ? rect_traits::top( rect ) - y : y > rect_traits::bottom( rect ) ? y - rect_traits::bottom( rect ) : zero;
+			distances[ i ] = ( dx * dx ) + ( dy * dy );
+		}
+	}
+private:
+	using real = std::common_type_t<scalar_type, float>;
+	static constexpr auto limit = real( std::numeric_limits<std::uint16_t>::max() );
+
+	static real scale_for( scalar_type low, scalar_type high )noexcept {
+		return high > low ? limit / ( real( high ) - real( low ) ) : real( 0 );
+	}
+	// The same rounding is used for elements and queries, which keeps the mapping monotonic,
+	// so flooring low edges and ceiling high edges can only widen a rect
+	static std::uint16_t quantize( real position, bool round_up )noexcept {
+		const auto rounded = round_up ? std::ceil( position ) : std::floor( position );
+		if( !( rounded > real( 0 ) ) ) return 0;
+		if( rounded >= limit ) return std::numeric_limits<std::uint16_t>::max();
+		return std::uint16_t( rounded );
+	}
+	std::uint16_t low_x( scalar_type x )const noexcept {
+		return quantize( ( real( x ) - m_origin_x ) * m_scale_x, false );
+	}
+	std::uint16_t high_x( scalar_type x )const noexcept {
+		return quantize( ( real( x ) - m_origin_x ) * m_scale_x, true );
+	}
+	std::uint16_t low_y( scalar_type y )const noexcept {
+		return quantize( ( real( y ) - m_origin_y ) * m_scale_y, false );
+	}
+	std::uint16_t high_y( scalar_type y )const noexcept {
+		return quantize( ( real( y ) - m_origin_y ) * m_scale_y, true );
+	}
+
+	rect_kernels::columns<std::uint16_t> view( std::size_t first, std::size_t count )const noexcept {
+		return { m_left.data() + first, m_top.data() + first, m_right.data() + first, m_bottom.data() + first, count };
+	}
+	// Compacts hits to the candidates whose full bounds pass test
+	template<typename Test>
+	std::size_t keep_if( std::uint32_t* hits, std::size_t candidates, Test&& test )const noexcept {
+		auto hit_count = std::size_t{};
+		for( std::size_t i = 0; i < candidates; ++i ) {
+			hits[ hit_count ] = hits[ i ];
+			hit_count += test( m_rects[ hits[ i ] ] ) ? 1 : 0;
+		}
+		return hit_count;
+	}
+private:
+	real m_origin_x, m_origin_y, m_scale_x, m_scale_y;
+	std::vector<std::uint16_t> m_left, m_top, m_right, m_bottom;
+	std::vector<rect_type> m_rects;
+};
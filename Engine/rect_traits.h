@@ -1,15 +1,35 @@
 #pragma once
 
+#include "rect_kernels.h"
 #include "vector_traits.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
 #include <numeric>
+#include <optional>
+#include <span>
+#include <type_traits>
 #include <utility>
 
+// SSE2 is part of x64, so the four quadrant tests below use it for float rects there
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define RECT_TRAITS_SSE2 1
+#include <emmintrin.h>
+#endif
+
 template<typename RectMemberAccess>
 struct rect_traits {
 	using access_traits = RectMemberAccess;
 	using rect_type = typename RectMemberAccess::rect_type;
 	using scalar_type = decltype( RectMemberAccess::left( std::declval<rect_type>() ) );
 
+	// Access traits can declare a packed_float_layout when rect_type is nothing but four floats,
+	// giving where each edge sits.  The batch functions then vectorize over spans of rects.
+	static constexpr bool packed_floats =
+		requires { access_traits::packed_float_layout; } &&
+		std::is_same_v<std::remove_cvref_t<scalar_type>, float> &&
+		sizeof( rect_type ) == sizeof( float ) * 4;
+
 	static constexpr auto construct( scalar_type left_, scalar_type top_, scalar_type right_, scalar_type bottom_ )noexcept {
 		return access_traits::construct( left_, top_, right_, bottom_ );
 	}
@@ -56,5 +76,188 @@ struct rect_traits {
 			( Vec2AccessTraits::x( rhs ) >= left( lhs ) && Vec2AccessTraits::x( rhs ) < right( lhs ) ) &&
 			( Vec2AccessTraits::y( rhs ) >= top( lhs ) && Vec2AccessTraits::y( rhs ) < bottom( lhs ) );
 	}
+
+
+	// Indices of the rects intersecting query go to hits, in order, and the count is returned.
+	// hits needs room for rects.size() entries.
+	static std::size_t intersects_many( rect_type const& query, std::span<rect_type const> rects, std::uint32_t* hits )noexcept {
+		if constexpr( packed_floats ) {
+			return rect_kernels::intersect_packed(
+				left( query ), top( query ), right( query ), bottom( query ),
+				reinterpret_cast<float const*>( rects.data() ), access_traits::packed_float_layout, rects.size(), hits );
+		}
+		else {
+			auto hit_count = std::size_t{};
+			for( std::size_t i = 0; i < rects.size(); ++i ) {
+				hits[ hit_count ] = std::uint32_t( i );
+				hit_count += intersects( rects[ i ], query ) ? 1 : 0;
+			}
+			return hit_count;
+		}
+	}
+	// Indices of the points inside rect go to hits, in order, and the count is returned.
+	// hits needs room for points.size() entries.
+	template<typename Vec2AccessTraits>
+	static std::size_t contains_many( rect_type const& rect, std::span<typename Vec2AccessTraits::vector_type const> points, std::uint32_t* hits )noexcept {
+		if constexpr( packed_floats && vector2_traits<Vec2AccessTraits>::packed_floats ) {
+			return rect_kernels::contain_packed(
+				left( rect ), top( rect ), right( rect ), bottom( rect ),
+				reinterpret_cast<float const*>( points.data() ), points.size(), hits );
+		}
+		else {
+			auto hit_count = std::size_t{};
+			for( std::size_t i = 0; i < points.size(); ++i ) {
+				hits[ hit_count ] = std::uint32_t( i );
+				hit_count += contains<Vec2AccessTraits>( rect, points[ i ] ) ? 1 : 0;
+			}
+			return hit_count;
+		}
+	}
+
+	// Squared distance from point to the closest point on rect, zero if point is inside
+	template<typename Vec2AccessTraits>
+	static constexpr auto distance_sqr( rect_type const& rect, typename Vec2AccessTraits::vector_type const& point )noexcept {
+		constexpr auto zero = scalar_type( 0 );
+		const auto px = Vec2AccessTraits::x( point );
+		const auto py = Vec2AccessTraits::y( point );
+
+		const auto dx =
+			px < left( rect ) ? left( rect ) - px :
+			px > right( rect ) ? px - right( rect ) : zero;
+		const auto dy =
+			py < top( rect ) ? top( rect ) - py :
+			py > bottom( rect ) ? py - bottom( rect ) : zero;
+
+		return ( dx * dx ) + ( dy * dy );
+	}
+	// Circle vs rect, touching counts as intersecting
+	template<typename Vec2AccessTraits>
+	static constexpr bool intersects( rect_type const& rect, typename Vec2AccessTraits::vector_type const& center, scalar_type radius )noexcept {
+		return distance_sqr<Vec2AccessTraits>( rect, center ) <= radius * radius;
+	}
+
+	// Slab test of origin + ( direction * t ) for t in [0, max_t], touching counts as a hit.
+	// Returns the t where the ray enters rect, 0 if origin is already inside.
+	template<typename Vec2AccessTraits>
+	static constexpr std::optional<scalar_type> ray_entry(
+		rect_type const& rect,
+		typename Vec2AccessTraits::vector_type const& origin,
+		typename Vec2AccessTraits::vector_type const& direction,
+		scalar_type max_t )noexcept
+	{
+		auto t_min = scalar_type( 0 );
+		auto t_max = max_t;
+
+		auto slab = [&]( scalar_type start, scalar_type delta, scalar_type low, scalar_type high ) {
+			if( delta == scalar_type( 0 ) ) return start >= low && start <= high;
+
+			auto t_low = ( low - start ) / delta;
+			auto t_high = ( high - start ) / delta;
+			if( t_low > t_high ) std::swap( t_low, t_high );
+
+			t_min = std::max( t_min, t_low );
+			t_max = std::min( t_max, t_high );
+			return t_min <= t_max;
+		};
+
+		if( !slab( Vec2AccessTraits::x( origin ), Vec2AccessTraits::x( direction ), left( rect ), right( rect ) ) ||
+			!slab( Vec2AccessTraits::y( origin ), Vec2AccessTraits::y( direction ), top( rect ), bottom( rect ) ) )
+			return std::nullopt;
+
+		return t_min;
+	}
+	// Earliest fraction t in [0, 1] of displacement where moving touches target, 0 if they already touch.
+	// Same as casting moving's center against target grown by moving's half size.
+	template<typename Vec2AccessTraits>
+	static constexpr std::optional<scalar_type> swept_entry(
+		rect_type const& moving,
+		typename Vec2AccessTraits::vector_type const& displacement,
+		rect_type const& target )noexcept
+	{
+		const auto half_width = ( right( moving ) - left( moving ) ) / scalar_type( 2 );
+		const auto half_height = ( bottom( moving ) - top( moving ) ) / scalar_type( 2 );
+		const auto expanded = construct(
+			left( target ) - half_width,
+			top( target ) - half_height,
+			right( target ) + half_width,
+			bottom( target ) + half_height
+		);
+		const auto origin = Vec2AccessTraits::construct(
+			left( moving ) + half_width,
+			top( moving ) + half_height
+		);
+
+		return ray_entry<Vec2AccessTraits>( expanded, origin, displacement, scalar_type( 1 ) );
+	}
+
+	// Quadrants of bounds split at its center, numbered as in qtree's get_quadrant:
+	// 0 left top, 1 right top, 2 left bottom, 3 right bottom.
+	// Bit i is set when quadrant i intersects rect, the same test as intersects.
+	static unsigned quadrants_intersecting( rect_type const& bounds, rect_type const& rect )noexcept {
+		const auto cx = std::midpoint( left( bounds ), right( bounds ) );
+		const auto cy = std::midpoint( top( bounds ), bottom( bounds ) );
+#if defined( RECT_TRAITS_SSE2 )
+		if constexpr( std::is_same_v<scalar_type, float> ) {
+			const auto [quad_left, quad_top, quad_right, quad_bottom] = quadrant_edges( bounds, cx, cy );
+			const auto hits = _mm_and_ps(
+				_mm_and_ps( _mm_cmplt_ps( quad_left, _mm_set1_ps( right( rect ) ) ), _mm_cmpgt_ps( quad_right, _mm_set1_ps( left( rect ) ) ) ),
+				_mm_and_ps( _mm_cmplt_ps( quad_top, _mm_set1_ps( bottom( rect ) ) ), _mm_cmpgt_ps( quad_bottom, _mm_set1_ps( top( rect ) ) ) )
+			);
+			return unsigned( _mm_movemask_ps( hits ) );
+		}
+		else
+#endif
+		{
+			const auto west = left( bounds ) < right( rect ) && cx > left( rect );
+			const auto east = cx < right( rect ) && right( bounds ) > left( rect );
+			const auto north = top( bounds ) < bottom( rect ) && cy > top( rect );
+			const auto south = cy < bottom( rect ) && bottom( bounds ) > top( rect );
+			return
+				( west && north ? 1u : 0u ) | ( east && north ? 2u : 0u ) |
+				( west && south ? 4u : 0u ) | ( east && south ? 8u : 0u );
+		}
+	}
+	// Index of the quadrant of bounds that contains rect as contains does, -1 if rect straddles the center lines
+	static int quadrant_containing( rect_type const& bounds, rect_type const& rect )noexcept {
+		const auto cx = std::midpoint( left( bounds ), right( bounds ) );
+		const auto cy = std::midpoint( top( bounds ), bottom( bounds ) );
+#if defined( RECT_TRAITS_SSE2 )
+		if constexpr( std::is_same_v<scalar_type, float> ) {
+			const auto [quad_left, quad_top, quad_right, quad_bottom] = quadrant_edges( bounds, cx, cy );
+			const auto inside = _mm_and_ps(
+				_mm_and_ps( _mm_cmplt_ps( quad_left, _mm_set1_ps( left( rect ) ) ), _mm_cmpgt_ps( quad_right, _mm_set1_ps( right( rect ) ) ) ),
+				_mm_and_ps( _mm_cmplt_ps( quad_top, _mm_set1_ps( top( rect ) ) ), _mm_cmpgt_ps( quad_bottom, _mm_set1_ps( bottom( rect ) ) ) )
+			);
+			const auto mask = unsigned( _mm_movemask_ps( inside ) );
+			return mask == 0u ? -1 : std::countr_zero( mask );
+		}
+		else
+#endif
+		{
+			const auto column =
+				left( bounds ) < left( rect ) && cx > right( rect ) ? 0 :
+				cx < left( rect ) && right( bounds ) > right( rect ) ? 1 : -1;
+			const auto row =
+				top( bounds ) < top( rect ) && cy > bottom( rect ) ? 0 :
+				cy < top( rect ) && bottom( bounds ) > bottom( rect ) ? 2 : -1;
+			return column < 0 || row < 0 ? -1 : column + row;
+		}
+	}
+
+private:
+#if defined( RECT_TRAITS_SSE2 )
+	struct quadrant_lanes {
+		__m128 left, top, right, bottom;
+	};
+	// Edges of the four quadrants, one quadrant per lane
+	static quadrant_lanes quadrant_edges( rect_type const& bounds, float cx, float cy )noexcept {
+		return {
+			_mm_setr_ps( left( bounds ), cx, left( bounds ), cx ),
+			_mm_setr_ps( top( bounds ), top( bounds ), cy, cy ),
+			_mm_setr_ps( cx, right( bounds ), cx, right( bounds ) ),
+			_mm_setr_ps( cy, cy, bottom( bounds ), bottom( bounds ) )
+		};
+	}
+#endif
 };
 
@@ -0,0 +1,117 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+struct thread_pool::batch {
+	void* ptask = nullptr;
+	invoke_fn invoke = nullptr;
+	std::size_t count = std::size_t{};
+	std::atomic<std::size_t> next = std::size_t{};
+	std::mutex error_mutex;
+	std::exception_ptr error;
+};
+
+thread_pool::thread_pool( std::size_t threads ) {
+	const auto workers = std::max( threads, std::size_t( 1 ) ) - 1;
+	m_workers.reserve( workers );
+	try {
+		for( std::size_t i = 0; i < workers; ++i ) {
+			m_workers.emplace_back( [this] { worker_loop(); } );
+		}
+	}
+	catch( ... ) {
+		// Stop the workers that did start before giving up
+		{
+			std::lock_guard lock( m_mutex );
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for( auto& worker : m_workers ) worker.join();
+		throw;
+	}
+}
+
+thread_pool::~thread_pool() {
+	{
+		std::lock_guard lock( m_mutex );
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for( auto& worker : m_workers ) worker.join();
+}
+
+thread_pool& thread_pool::shared() {
+	static thread_pool pool;
+	return pool;
+}
+
+std::size_t thread_pool::default_threads()noexcept {
+	return std::max( std::thread::hardware_concurrency(), 1u );
+}
+
+void thread_pool::run_erased( std::size_t count, void* ptask, invoke_fn invoke ) {
+	if( count == std::size_t{} ) return;
+
+	std::lock_guard run_lock( m_run_mutex );
+	batch job;
+	job.ptask = ptask;
+	job.invoke = invoke;
+	job.count = count;
+
+	// A single index isn't worth waking anybody for
+	const auto helpers = count > 1 ? m_workers.size() : std::size_t{};
+	if( helpers != std::size_t{} ) {
+		{
+			std::lock_guard lock( m_mutex );
+			m_pbatch = &job;
+			m_busy = helpers;
+			++m_round;
+		}
+		m_wake.notify_all();
+	}
+
+	work( job );
+
+	if( helpers != std::size_t{} ) {
+		std::unique_lock lock( m_mutex );
+		m_done.wait( lock, [this] { return m_busy == std::size_t{}; } );
+		m_pbatch = nullptr;
+	}
+
+	if( job.error ) std::rethrow_exception( job.error );
+}
+
+void thread_pool::worker_loop() {
+	auto seen = std::size_t{};
+	for( ;; ) {
+		batch* pjob = nullptr;
+		{
+			std::unique_lock lock( m_mutex );
+			m_wake.wait( lock, [&] { return m_stop || m_round != seen; } );
+			if( m_stop ) return;
+
+			seen = m_round;
+			pjob = m_pbatch;
+		}
+
+		work( *pjob );
+
+		std::lock_guard lock( m_mutex );
+		if( --m_busy == std::size_t{} ) m_done.notify_one();
+	}
+}
+
+// Indices are handed out one at a time so uneven tasks still spread across every thread
+void thread_pool::work( batch& job )noexcept {
+	for( auto index = job.next.fetch_add( 1, std::memory_order_relaxed ); index < job.count; index = job.next.fetch_add( 1, std::memory_order_relaxed ) ) {
+		try {
+			job.invoke( job.ptask, index );
+		}
+		catch( ... ) {
+			std::lock_guard lock( job.error_mutex );
+			if( !job.error ) job.error = std::current_exception();
+			job.next.store( job.count, std::memory_order_relaxed );
+		}
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads for fork/join work such as the qtree bulk builds.  run( count, task )
+// calls task( index ) once for every index in [0, count), spread over the workers and the calling
+// thread, and returns when all of them are done.  One run at a time, a task must not call run on
+// the pool it is running on.
+class thread_pool {
+public:
+	// threads includes the calling thread, so thread_pool( 1 ) starts no workers and runs everything inline
+	explicit thread_pool( std::size_t threads = default_threads() );
+	~thread_pool();
+
+	thread_pool( thread_pool const& ) = delete;
+	thread_pool& operator=( thread_pool const& ) = delete;
+
+	// Threads a run is spread over, the caller included
+	std::size_t size()const noexcept {
+		return m_workers.size() + 1;
+	}
+
+	// The first exception thrown by a task is rethrown here once every thread has stopped,
+	// indices not yet started are skipped
+	template<typename Task>
+	void run( std::size_t count, Task&& task ) {
+		using task_type = std::remove_reference_t<Task>;
+		auto* ptask = const_cast<void*>( static_cast<void const*>( std::addressof( task ) ) );
+		run_erased( count, ptask, []( void* pdata, std::size_t index ) { ( *static_cast<task_type*>( pdata ) )( index ); } );
+	}
+
+	// Pool used when none is passed in, one thread per hardware thread
+	static thread_pool& shared();
+	static std::size_t default_threads()noexcept;
+private:
+	using invoke_fn = void( * )( void*, std::size_t );
+	struct batch;
+
+	void run_erased( std::size_t count, void* ptask, invoke_fn invoke );
+	void worker_loop();
+	static void work( batch& job )noexcept;
+private:
+	std::vector<std::thread> m_workers;
+	// Held for a whole run so callers on different threads take turns
+	std::mutex m_run_mutex;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	batch* m_pbatch = nullptr;
+	std::size_t m_round = std::size_t{};
+	std::size_t m_busy = std::size_t{};
+	bool m_stop = false;
+};
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "rect_kernels.h"
 #include <cmath>
+#include <span>
+#include <type_traits>
 #include <utility>
 
 template<typename Vec2MemberAccess> struct vector2_traits {
@@ -8,6 +11,13 @@ template<typename Vec2MemberAccess> struct vector2_traits {
 	using vector_type = typename Vec2MemberAccess::vector_type;
 	using scalar_type = decltype( Vec2MemberAccess::x( std::declval<typename access_traits::vector_type>() ) );
 
+	// Access traits can declare packed_floats when vector_type is nothing but float x then float y.
+	// The batch functions then treat a span of vectors as an array of floats and vectorize.
+	static constexpr bool packed_floats =
+		requires { requires access_traits::packed_floats; } &&
+		std::is_same_v<std::remove_cvref_t<scalar_type>, float> &&
+		sizeof( vector_type ) == sizeof( float ) * 2;
+
 	static constexpr auto construct( scalar_type x_, scalar_type y_ )noexcept {
 		return access_traits::construct( x_, y_ );
 	}
@@ -47,5 +57,16 @@ template<typename Vec2MemberAccess> struct vector2_traits {
 			return vector_type{ x( vec ) / len, y( vec ) / len };
 		}
 	}
+	// normalize on every vector in place
+	static void normalize_many( std::span<vector_type> vecs )noexcept {
+		if constexpr( packed_floats ) {
+			rect_kernels::normalize_packed( reinterpret_cast<float*>( vecs.data() ), vecs.size() );
+		}
+		else {
+			for( auto& vec : vecs ) {
+				vec = normalize( vec );
+			}
+		}
+	}
 };
 